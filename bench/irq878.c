@@ -41,13 +41,27 @@ struct rr_iocmd iocmd = {
 	.datasize = 4,
 };
 
+/* With "k" on the command line, the driver acknowledges by itself */
+struct rr_irqack irqack = {
+	.status = ACK_REG,
+	.mask = ENA_VAL,
+	.ack = ACK_REG,
+	.flags = RR_IRQACK_ENABLE | RR_IRQACK_STATUS,
+};
+
 int main(int argc, char **argv)
 {
-	int fd, count, count0, nsec;
+	int fd, count, count0, nsec, kack = 0;
 	unsigned long long total = 0LL;
+	struct timeval tv1, tv2;
 
+	if (argc == 3 && !strcmp(argv[2], "k")) {
+		kack = 1;
+		argc--;
+	}
 	if (argc != 2) {
-		fprintf(stderr, "%s: use \"%s <count>\"\n", argv[0], argv[0]);
+		fprintf(stderr, "%s: use \"%s <count> [k]\"\n", argv[0],
+			argv[0]);
 		exit(1);
 	}
 	count0 = count = atoi(argv[1]);
@@ -80,6 +94,29 @@ int main(int argc, char **argv)
 	}
 	iocmd.address = ACK_REG;
 
+	if (kack) {
+		if (ioctl(fd, RR_IRQACK, &irqack) < 0) {
+			fprintf(stderr, "%s: %s: ioctl: %s\n", argv[0],
+				DEVNAME, strerror(errno));
+			exit(1);
+		}
+		/* one system call per interrupt, and nothing to re-enable */
+		gettimeofday(&tv1, NULL);
+		while (count) {
+			if (ioctl(fd, RR_IRQWAIT) < 0) {
+				fprintf(stderr, "%s: %s: ioctl: %s\n", argv[0],
+					DEVNAME, strerror(errno));
+				exit(1);
+			}
+			count--;
+		}
+		gettimeofday(&tv2, NULL);
+		total = (tv2.tv_sec - tv1.tv_sec) * 1000LL * 1000LL * 1000LL
+			+ (tv2.tv_usec - tv1.tv_usec) * 1000LL;
+		irqack.flags = 0;
+		ioctl(fd, RR_IRQACK, &irqack);
+	}
+
 	while (count) {
 		nsec = ioctl(fd, RR_IRQWAIT);
 		if (nsec < 0) {
@@ -113,8 +150,12 @@ int main(int argc, char **argv)
 	iocmd.data32 = ~0;
 	ioctl(fd, RR_WRITE, &iocmd);
 
-	printf("got %i interrupts, average delay %lins\n", count0,
-	       (long)(total / count0));
+	if (kack)
+		printf("got %i interrupts, average period %lins\n", count0,
+		       (long)(total / count0));
+	else
+		printf("got %i interrupts, average delay %lins\n", count0,
+		       (long)(total / count0));
 	exit(0);
 
 }
@@ -0,0 +1,89 @@
+/*
+ * Trivial performance test for mmap(2) I/O
+ *
+ * Copyright (C) 2010 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * Released according to the GNU GPL, version 2 or any later version.
+ *
+ * This work is part of the White Rabbit project, a research effort led
+ * by CERN, the European Institute for Nuclear Research.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "rawrabbit.h"
+
+#define DEVNAME "/dev/rawrabbit"
+
+int main(int argc, char **argv)
+{
+	int fd, count, count0, usec;
+	struct timeval tv1, tv2;
+	volatile uint32_t *reg;
+	void *map;
+
+	if (argc != 2) {
+		fprintf(stderr, "%s: use \"%s <count>\"\n", argv[0], argv[0]);
+		exit(1);
+	}
+	count0 = count = atoi(argv[1]);
+	if (!count) {
+		fprintf(stderr, "%s: not a number \"%s\"\n", argv[0], argv[1]);
+		exit(1);
+	}
+
+	fd = open(DEVNAME, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], DEVNAME,
+			strerror(errno));
+		exit(1);
+	}
+
+	/* map the first page of bar 4, where the GPIO registers live */
+	map = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, __RR_SET_BAR(4));
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: %s: mmap: %s\n", argv[0], DEVNAME,
+			strerror(errno));
+		exit(1);
+	}
+	reg = map + 0xa08;
+
+	/* write */
+	gettimeofday(&tv1, NULL);
+	while (count--) {
+		static uint32_t values[] = {0x0000, 0xf000};
+
+		*reg = values[count & 1];
+	}
+	gettimeofday(&tv2, NULL);
+	usec = (tv2.tv_sec - tv1.tv_sec) * 1000 * 1000
+		+ tv2.tv_usec - tv1.tv_usec;
+	printf("%i writes in %i usecs\n", count0, usec);
+	printf("%i writes per second\n",
+	       (int)(count0 * 1000LL * 1000LL / usec));
+
+	/* read: we cut and paste the code, oh so lazy */
+	count = count0;
+	gettimeofday(&tv1, NULL);
+	while (count--)
+		(void)*reg; /* volatile, so the load is performed */
+	gettimeofday(&tv2, NULL);
+	usec = (tv2.tv_sec - tv1.tv_sec) * 1000 * 1000
+		+ tv2.tv_usec - tv1.tv_usec;
+	printf("%i reads in %i usecs\n", count0, usec);
+	printf("%i reads per second\n",
+	       (int)(count0 * 1000LL * 1000LL / usec));
+
+	munmap(map, getpagesize());
+	exit(0);
+}
@@ -25,6 +25,11 @@ static inline void writeq(__u64 val, volatile void __iomem *addr)
    #endif
 #endif /* X86 */
 
+/* VM_RESERVED was removed in 3.7, what replaces it is these two flags */
+#ifndef VM_RESERVED
+#define VM_RESERVED (VM_DONTEXPAND | VM_DONTDUMP)
+#endif
+
 /*
  * request_firmware_nowait adds a gfp_t argument at some point:
  * patch 9ebfbd45f9d4ee9cd72529cf99e5f300eb398e67 == v2.6.32-5357-g9ebfbd4
@@ -35,6 +40,213 @@ static inline void writeq(__u64 val, volatile void __iomem *addr)
 #define __RR_GFP_FOR_RFNW(x)  /* nothing */
 #endif
 
+/*
+ * pci_alloc_irq_vectors appeared in 4.8. Before it, use MSI if possible,
+ * with a single vector, like most drivers did at the time
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
+#define PCI_IRQ_LEGACY		(1 << 0)
+#define PCI_IRQ_MSI		(1 << 1)
+#define PCI_IRQ_MSIX		(1 << 2)
+#define PCI_IRQ_ALL_TYPES	(PCI_IRQ_LEGACY | PCI_IRQ_MSI | PCI_IRQ_MSIX)
+
+static inline int pci_alloc_irq_vectors(struct pci_dev *pdev, unsigned int min,
+					unsigned int max, unsigned int flags)
+{
+	if ((flags & PCI_IRQ_MSI) && !pci_enable_msi(pdev))
+		return 1;
+	if ((flags & PCI_IRQ_LEGACY) && pdev->irq > 0)
+		return 1;
+	return -ENOSPC;
+}
+
+static inline int pci_irq_vector(struct pci_dev *pdev, unsigned int nr)
+{
+	return nr ? -EINVAL : pdev->irq;
+}
+
+static inline void pci_free_irq_vectors(struct pci_dev *pdev)
+{
+	if (pdev->msi_enabled)
+		pci_disable_msi(pdev);
+}
+#endif
+
+/* PCI_IRQ_LEGACY was renamed PCI_IRQ_INTX in 6.8, then removed */
+#ifndef PCI_IRQ_LEGACY
+#define PCI_IRQ_LEGACY		PCI_IRQ_INTX
+#endif
+
+/* access_ok lost its type argument in 5.0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+#define __RR_ACCESS_OK(type, addr, size)  access_ok(addr, size)
+#else
+#define __RR_ACCESS_OK(type, addr, size)  access_ok(type, addr, size)
+#endif
+
+/* vm_flags can't be written directly since 6.3 */
+#include <linux/mm.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+static inline void vm_flags_set(struct vm_area_struct *vma,
+				unsigned long flags)
+{
+	vma->vm_flags |= flags;
+}
+#endif
+
+/*
+ * vm_fault_t and vmf_insert_pfn appeared in 4.17; the fault method lost
+ * its vma argument in 4.11, and the faulting address was a pointer
+ * before 4.10
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+typedef int vm_fault_t;
+static inline vm_fault_t vmf_insert_pfn(struct vm_area_struct *vma,
+					unsigned long addr, unsigned long pfn)
+{
+	int err = vm_insert_pfn(vma, addr, pfn);
+
+	if (err == -ENOMEM)
+		return VM_FAULT_OOM;
+	if (err < 0 && err != -EBUSY)
+		return VM_FAULT_SIGBUS;
+	return VM_FAULT_NOPAGE;
+}
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#define __RR_FAULT_ARGS		struct vm_fault *vmf
+#define __RR_FAULT_VMA(vmf)	((vmf)->vma)
+#else
+#define __RR_FAULT_ARGS		struct vm_area_struct *__vma, \
+				struct vm_fault *vmf
+#define __RR_FAULT_VMA(vmf)	__vma
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+#define __RR_FAULT_ADDR(vmf)	((vmf)->address)
+#else
+#define __RR_FAULT_ADDR(vmf)	((unsigned long)(vmf)->virtual_address)
+#endif
+
+/* pr_warning was removed in 5.8 */
+#ifndef pr_warning
+#define pr_warning pr_warn
+#endif
+
+/* eventfd_signal lost its count argument in 6.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+#define __RR_EVENTFD_SIGNAL(ctx)  eventfd_signal(ctx)
+#else
+#define __RR_EVENTFD_SIGNAL(ctx)  eventfd_signal(ctx, 1)
+#endif
+
+/* hrtimer_setup replaced hrtimer_init plus the function assignment in 6.13 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+static inline void hrtimer_setup(struct hrtimer *timer,
+				 enum hrtimer_restart (*fn)(struct hrtimer *),
+				 clockid_t clock_id, enum hrtimer_mode mode)
+{
+	hrtimer_init(timer, clock_id, mode);
+	timer->function = fn;
+}
+#endif
+
+/*
+ * The uring_cmd file operation appeared in 5.19. The sqe is passed
+ * whole since 6.4, and the header was split out in 6.7
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+#define __RR_HAS_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+#define __RR_URING_CMD_PDU(ioucmd)  io_uring_sqe_cmd((ioucmd)->sqe)
+#else
+#define __RR_URING_CMD_PDU(ioucmd)  ((ioucmd)->cmd)
+#endif
+#endif
+
+/*
+ * dma-buf exporters need no kmap callbacks since 4.19. The symbols
+ * moved to a namespace in 5.16, named by a string since 6.13
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+#define __RR_HAS_DMABUF
+#include <linux/dma-buf.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+#define __RR_IMPORT_NS_DMA_BUF  MODULE_IMPORT_NS("DMA_BUF")
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+#define __RR_IMPORT_NS_DMA_BUF  MODULE_IMPORT_NS(DMA_BUF)
+#endif
+#endif
+
+/*
+ * pin_user_pages_fast and unpin_user_pages_dirty_lock appeared in 5.6;
+ * before them get_user_pages_fast took a write flag until 5.2
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+#ifndef FOLL_LONGTERM
+#define FOLL_LONGTERM 0
+#endif
+static inline int pin_user_pages_fast(unsigned long start, int nr_pages,
+				      unsigned int gup_flags,
+				      struct page **pages)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+	return get_user_pages_fast(start, nr_pages, gup_flags & FOLL_WRITE,
+				   pages);
+#else
+	return get_user_pages_fast(start, nr_pages, gup_flags, pages);
+#endif
+}
+
+static inline void unpin_user_pages_dirty_lock(struct page **pages,
+					       unsigned long npages,
+					       bool make_dirty)
+{
+	unsigned long i;
+
+	for (i = 0; i < npages; i++) {
+		if (make_dirty)
+			set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+}
+#endif
+
+/*
+ * driver_override, to probe a single device, appeared in 3.16; since
+ * 5.19 it is written through driver_set_override. An empty name clears it
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+#define __RR_HAS_DRIVER_OVERRIDE
+#define __RR_SET_OVERRIDE(pdev, name) \
+	driver_set_override(&(pdev)->dev, &(pdev)->driver_override, \
+			    name, strlen(name))
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+#define __RR_HAS_DRIVER_OVERRIDE
+#include <linux/pci.h>
+#include <linux/slab.h>
+static inline int __RR_SET_OVERRIDE(struct pci_dev *pdev, const char *name)
+{
+	char *new = NULL, *old;
+
+	if (*name) {
+		new = kstrdup(name, GFP_KERNEL);
+		if (!new)
+			return -ENOMEM;
+	}
+	device_lock(&pdev->dev);
+	old = pdev->driver_override;
+	pdev->driver_override = new;
+	device_unlock(&pdev->dev);
+	kfree(old);
+	return 0;
+}
+#endif
+
 /* Hack... something I sometimes need */
 static inline void dumpstruct(char *name, void *ptr, int size)
 {
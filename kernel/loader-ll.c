@@ -40,16 +40,7 @@ static uint32_t unaligned_bitswap_le32(const uint32_t *ptr32)
 
 static inline void gpio_out(int fd, void __iomem *bar4, const uint32_t addr, const int bit, const int value)
 {
-	uint32_t reg;
-
-	reg = lll_read(fd, bar4, addr);
-
-	if(value)
-		reg |= (1<<bit);
-	else
-		reg &= ~(1<<bit);
-
-	lll_write(fd, bar4, reg, addr);
+	lll_rmw(fd, bar4, 1 << bit, value ? 1 << bit : 0, addr);
 }
 
 /*
@@ -61,6 +52,7 @@ int loader_low_level(int fd, void __iomem *bar4, const void *data, int size8)
 {
 	int size32 = (size8 + 3) >> 2;
 	const uint32_t *data32 = data;
+	uint32_t fifo[LLL_FIFO_CHUNK];
 	int ctrl = 0, i, done = 0, wrote = 0;
 
 
@@ -129,11 +121,11 @@ int loader_low_level(int fd, void __iomem *bar4, const void *data, int size8)
 			;
 
 		/* Write a few dwords into FIFO at a time. */
-		for (i = 0; size32 && i < 32; i++) {
-			lll_write(fd, bar4, unaligned_bitswap_le32(data32),
-				  FCL_FIFO);
+		for (i = 0; size32 && i < LLL_FIFO_CHUNK; i++) {
+			fifo[i] = unaligned_bitswap_le32(data32);
 			data32++; size32--; wrote++;
 		}
+		lll_write_fifo(fd, bar4, fifo, i, FCL_FIFO);
 	}
 
 	lll_write(fd, bar4, 0x186, FCL_CTRL); /* "last data written" */
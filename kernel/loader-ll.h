@@ -17,6 +17,8 @@ extern int loader_low_level(
 /* The following part implements a different access rule for user and kernel */
 #ifdef __LOADER_LL_C__
 
+#define LLL_FIFO_CHUNK 32 /* words written to the fifo at a time */
+
 #ifdef __KERNEL__
 
 #include <asm/io.h>
@@ -32,6 +34,21 @@ static inline u32 lll_read(int fd, void __iomem *bar4, int reg)
 	return readl(bar4 + reg);
 }
 
+/* Replace the mask bits of a register with val */
+static inline void lll_rmw(int fd, void __iomem *bar4, u32 mask, u32 val,
+			   int reg)
+{
+	writel((readl(bar4 + reg) & ~mask) | (val & mask), bar4 + reg);
+}
+
+/* Write several values to the same register (i.e., a fifo) */
+static inline void lll_write_fifo(int fd, void __iomem *bar4,
+				  const u32 *val, int n, int reg)
+{
+	while (n--)
+		writel(*val++, bar4 + reg);
+}
+
 #else /* ! __KERNEL__ */
 
 #include <stdio.h>
@@ -62,6 +79,46 @@ static inline uint32_t lll_read(int fd, void __iomem *bar4, int reg)
 	return iocmd.data32;
 }
 
+/* Read-modify-write, with a single system call */
+static inline void lll_rmw(int fd, void __iomem *bar4, uint32_t mask,
+			   uint32_t val, int reg)
+{
+	struct rr_seqop op = {
+		.op = RR_SEQ_RMW,
+		.address = reg | __RR_SET_BAR(4),
+		.mask = mask,
+		.value = val,
+	};
+	struct rr_seq seq = {
+		.nops = 1,
+		.ops = (uintptr_t)&op,
+	};
+
+	if (ioctl(fd, RR_SEQ, &seq) < 0) perror("ioctl(SEQ)");
+	return;
+}
+
+/* Write several values to the same register, with a single system call */
+static inline void lll_write_fifo(int fd, void __iomem *bar4,
+				  const uint32_t *val, int n, int reg)
+{
+	struct rr_iocmd iocmd[LLL_FIFO_CHUNK];
+	struct rr_iov iov = {
+		.cmd = RR_WRITE,
+		.nr = n,
+		.iocmd = (uintptr_t)iocmd,
+	};
+	int i;
+
+	for (i = 0; i < n; i++) {
+		iocmd[i].datasize = 4;
+		iocmd[i].address = reg | __RR_SET_BAR(4);
+		iocmd[i].data32 = val[i];
+	}
+	if (ioctl(fd, RR_IOV, &iov) != 0) perror("ioctl(IOV)");
+	return;
+}
+
 #define KERN_ERR /* nothing */
 #define printk(format, ...) fprintf (stderr, format, ## __VA_ARGS__)
 
@@ -28,12 +28,14 @@ static int param_set_par_fwname(const char *val, struct kernel_param *kp)
 {
 	const char *prev = *(const char **)kp->arg;
 	int ret = param_set_charp(val, kp);
-	extern struct rr_dev rr_dev; /* global: no good */
-	struct rr_dev *dev = &rr_dev;
+	extern struct rr_dev *rr_selected; /* global: no good */
+	struct rr_dev *dev = rr_selected;
 	static char fwname[RR_MAX_FWNAME_SIZE];
 
 	if (ret)
 		  return ret;
+	if (!dev) /* no board selected: the name is used at probe time */
+		return 0;
 	ret = rr_expand_name(dev, fwname);
 	if (ret) {
 		/*
@@ -24,7 +24,14 @@
 #include <linux/vmalloc.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
-#include <asm/uaccess.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
+#include <linux/uaccess.h>
 
 #include "rawrabbit.h"
 #include "compat.h"
@@ -37,431 +44,2195 @@ module_param_named(device, rr_device, int, 0);
 static int rr_bufsize = RR_DEFAULT_BUFSIZE;
 module_param_named(bufsize, rr_bufsize, int, 0);
 
-struct rr_dev rr_dev; /* defined later */
+static int rr_hugebuf = 1; /* build buffers from huge pages, if possible */
+module_param_named(hugebuf, rr_hugebuf, int, 0644);
 
-/* Interrupt handler: just disable the interrupt in the controller */
-irqreturn_t rr_interrupt(int irq, void *devid)
+/*
+ * Every matching board is bound, with its own rr_dev and misc device.
+ * /dev/rawrabbit opens the board selected by the module parameters or
+ * RR_DEVSEL, or a device with no board when nothing is selected.
+ */
+static LIST_HEAD(rr_boards);		/* under rr_boards_mutex */
+static DEFINE_MUTEX(rr_boards_mutex);
+static DEFINE_MUTEX(rr_attach_mutex);	/* serializes rr_devsel_attach */
+static DECLARE_COMPLETION(rr_probe_done);
+static struct rr_devsel rr_devsel;
+static struct rr_dev *rr_nodev;
+struct rr_dev *rr_selected;		/* loader.c uses it too */
+
+/* All open files share one address space, so BAR mappings can be zapped */
+static DEFINE_MUTEX(rr_inode_mutex);
+static struct inode *rr_inode;		/* under rr_inode_mutex */
+static int rr_nfiles;
+
+/* defined later */
+static struct pci_driver rr_pcidrv;
+static struct miscdevice rr_misc;
+static struct file_operations rr_fops;
+
+/* With the event lock held: deliver the pending events as one batch */
+static void rr_mod_flush(struct rr_dev *dev)
 {
-	struct rr_dev *dev = devid;
+	struct rr_mod *m = &dev->mod;
+	struct rr_file *rf;
+
+	m->seq++;
+	m->bcount = m->pending;
+	m->bfirst = m->first;
+	m->blast = m->last;
+	m->pending = 0;
+	list_for_each_entry(rf, &dev->evfiles, evlist)
+		__RR_EVENTFD_SIGNAL(rf->evfd);
+	hrtimer_try_to_cancel(&m->timer);
+}
 
-	getnstimeofday(&dev->irqtime);
-	dev->irqcount++;
-	dev->flags |= RR_FLAG_IRQDISABLE;
-	disable_irq_nosync(irq);
-	wake_up_interruptible(&dev->q);
-	return IRQ_HANDLED;
+/* The moderation window expired: deliver what we have */
+static enum hrtimer_restart rr_mod_timer(struct hrtimer *t)
+{
+	struct rr_dev *dev = container_of(t, struct rr_dev, mod.timer);
+	unsigned long flags;
+	int wake = 0;
+
+	spin_lock_irqsave(&dev->evlock, flags);
+	if (dev->mod.pending) {
+		rr_mod_flush(dev);
+		wake = 1;
+	}
+	spin_unlock_irqrestore(&dev->evlock, flags);
+	if (wake)
+		wake_up_interruptible(&dev->q);
+	return HRTIMER_NORESTART;
 }
 
 /*
- * We have a PCI driver, used to access the BAR areas.
- * One device id only is supported. 
+ * Record an event in the ring, and wake up all readers and pollers.
+ * With moderation active, the wakeup is delayed to the end of the batch.
  */
+static void rr_event_record(struct rr_dev *dev, int source)
+{
+	struct rr_mod *m = &dev->mod;
+	struct rr_event *e;
+	unsigned long flags;
+	u64 now = ktime_to_ns(ktime_get());
+	int wake = 0;
+
+	spin_lock_irqsave(&dev->evlock, flags);
+	e = dev->events + (dev->evseq & (RR_NEVENTS - 1));
+	e->seq = dev->evseq++;
+	e->nsec = now;
+	e->source = source;
+
+	if (!m->pending++)
+		m->first = now;
+	m->last = now;
+	/* A disabled line brings no more events until RR_IRQENA: deliver */
+	if ((m->count && m->pending >= m->count) || (!m->count && !m->usecs)
+	    || (source == RR_EVENT_IRQ && (dev->flags & RR_FLAG_IRQDISABLE))) {
+		rr_mod_flush(dev);
+		wake = 1;
+	} else if (m->pending == 1 && m->usecs) {
+		hrtimer_start(&m->timer, ns_to_ktime(m->usecs * 1000ULL),
+			      HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&dev->evlock, flags);
+	if (wake)
+		wake_up_interruptible(&dev->q);
+}
 
-static struct pci_device_id rr_idtable[2]; /* last must be zero */
+/* Account a latency, from the last interrupt to now, in a histogram */
+static void rr_latency_record(struct rr_dev *dev, struct rr_hist *h)
+{
+	unsigned long flags;
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), dev->irqstamp));
+	int i = fls64(ns | 1) - 1;
+
+	if (i >= RR_HIST_BUCKETS)
+		i = RR_HIST_BUCKETS - 1;
+	spin_lock_irqsave(&dev->evlock, flags);
+	if (!h->count || ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->count++;
+	h->sum += ns;
+	h->bucket[i]++;
+	spin_unlock_irqrestore(&dev->evlock, flags);
+}
 
-static void rr_fill_table(struct rr_dev *dev)
+/* Return the histograms, and reset them if so asked: too big for karg */
+static int rr_get_latency(struct rr_dev *dev, struct rr_latency __user *arg)
 {
-	if (dev->devsel->subvendor == RR_DEVSEL_UNUSED) {
-		dev->id_table->subvendor = PCI_ANY_ID;
-		dev->id_table->subdevice = PCI_ANY_ID;
-	} else {
-		dev->id_table->subvendor = dev->devsel->subvendor;
-		dev->id_table->subdevice = dev->devsel->subdevice;
+	struct rr_latency *lat;
+	int ret = 0;
+
+	lat = kmalloc(sizeof(*lat), GFP_KERNEL);
+	if (!lat)
+		return -ENOMEM;
+	if (get_user(lat->flags, &arg->flags)) {
+		ret = -EFAULT;
+		goto out;
 	}
-	dev->id_table->vendor = dev->devsel->vendor;
-	dev->id_table->device = dev->devsel->device;
+	spin_lock_irq(&dev->evlock);
+	lat->wakeup = dev->lat->wakeup;
+	lat->ack = dev->lat->ack;
+	if (lat->flags & RR_LATENCY_RESET)
+		memset(dev->lat, 0, sizeof(*dev->lat));
+	spin_unlock_irq(&dev->evlock);
+	lat->unused = 0;
+	if (copy_to_user(arg, lat, sizeof(*lat)))
+		ret = -EFAULT;
+ out:
+	kfree(lat);
+	return ret;
 }
 
-static int rr_fill_table_and_probe(struct rr_dev *dev)
+/* Change the moderation parameters, delivering what is pending */
+static int rr_set_irqmod(struct rr_dev *dev, struct rr_irqmod *mod)
 {
-	int ret;
+	int wake = 0;
 
-	/* This needs no locks, as it's called in semaphorized process ctxt */
-	if (dev->flags & RR_FLAG_REGISTERED) {
-		pci_unregister_driver(dev->pci_driver);
-		dev->flags &= ~ RR_FLAG_REGISTERED;
+	if (mod->usecs > RR_IRQMOD_MAX_USECS)
+		return -EINVAL;
+	spin_lock_irq(&dev->evlock);
+	dev->mod.count = mod->count;
+	dev->mod.usecs = mod->usecs;
+	if (dev->mod.pending) {
+		rr_mod_flush(dev);
+		wake = 1;
 	}
+	spin_unlock_irq(&dev->evlock);
+	if (wake)
+		wake_up_interruptible(&dev->q);
+	return 0;
+}
 
-	rr_fill_table(dev);
-
-	/* Use the completion mechanism to be notified of probes */
-	init_completion(&dev->complete);
-	ret = pci_register_driver(dev->pci_driver);
-	if (ret == 0)
-		dev->flags |= RR_FLAG_REGISTERED;
+/* Wait for a batch this file has not seen yet, and return it */
+static int rr_irqbatch(struct rr_file *rf, struct rr_irqbatch *b)
+{
+	struct rr_dev *dev = rf->dev;
+	struct rr_mod *m = &dev->mod;
+	int ret;
 
-	if (ret < 0) {
-		printk(KERN_ERR "%s: Can't register pci driver\n",
-		       KBUILD_MODNAME);
+	ret = wait_event_interruptible(dev->q, m->seq != rf->batchseq);
+	if (ret)
 		return ret;
+	spin_lock_irq(&dev->evlock);
+	b->seq = m->seq;
+	b->count = m->bcount;
+	b->unused = 0;
+	b->first = m->bfirst;
+	b->last = m->blast;
+	spin_unlock_irq(&dev->evlock);
+	rf->batchseq = b->seq;
+	return 0;
+}
+
+/*
+ * Bind an eventfd to the file (or unbind, if fd is negative). The file
+ * lock keeps RR_DEVSEL from moving evlist to another board meanwhile
+ */
+static int rr_set_eventfd(struct rr_file *rf, int fd)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+	struct rr_dev *dev;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
 	}
-	/* This ret is 0 (timeout) or positive */
-	ret = wait_for_completion_timeout(&dev->complete, RR_PROBE_TIMEOUT);
-	if (!ret) {
-		printk("%s: Warning: no device found\n", __func__);
+	mutex_lock(&rf->lock);
+	dev = rf->dev;
+	spin_lock_irq(&dev->evlock);
+	old = rf->evfd;
+	if (old && !ctx)
+		list_del(&rf->evlist);
+	if (!old && ctx)
+		list_add(&rf->evlist, &dev->evfiles);
+	rf->evfd = ctx;
+	spin_unlock_irq(&dev->evlock);
+	mutex_unlock(&rf->lock);
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+/* With the lock held: skip the events that have been overwritten */
+static void rr_event_catchup(struct rr_dev *dev, struct rr_file *rf)
+{
+	if (dev->evseq - rf->evnext > RR_NEVENTS) {
+		rf->evoverruns += dev->evseq - RR_NEVENTS - rf->evnext;
+		rf->evnext = dev->evseq - RR_NEVENTS;
 	}
-	return ret;
 }
 
-/* The probe and remove function can't get locks, as it's already locked */
-static int rr_pciprobe (struct pci_dev *pdev, const struct pci_device_id *id)
+/* Program the next segment of a DMA transfer, with the dma lock held */
+static void rr_dma_program(struct rr_dev *dev)
+{
+	struct rr_dma *d = &dev->dma;
+	void __iomem *regs = dev->remap[0];
+	dma_addr_t addr = sg_dma_address(d->sg) + d->sgoff;
+	unsigned long len = sg_dma_len(d->sg) - d->sgoff;
+
+	if (len > d->left)
+		len = d->left;
+	writel(d->devaddr, regs + GNDMA_CSTART);
+	writel(lower_32_bits(addr), regs + GNDMA_HSTARTL);
+	writel(upper_32_bits(addr), regs + GNDMA_HSTARTH);
+	writel(len, regs + GNDMA_LEN);
+	writel(0, regs + GNDMA_NEXTL);
+	writel(0, regs + GNDMA_NEXTH);
+	writel(d->todevice ? GNDMA_ATTRIB_TODEVICE : 0, regs + GNDMA_ATTRIB);
+	writel(GNDMA_CTRL_START, regs + GNDMA_CTRL);
+
+	d->curlen = len;
+	d->left -= len;
+	d->devaddr += len;
+	d->sgoff += len;
+	if (d->sgoff == sg_dma_len(d->sg)) {
+		d->sg = sg_next(d->sg);
+		d->sgoff = 0;
+	}
+}
+
+/*
+ * Sync only the range of a transfer (or a stream slot), not the whole
+ * table: the cost doesn't grow with the buffer, and with bounce buffers
+ * the rest of the cpu data is not overwritten
+ */
+static void rr_dma_sync_range(struct device *hwdev, struct sg_table *sgt,
+			      int nents, unsigned long off, unsigned long len,
+			      int todevice)
 {
-	struct rr_dev *dev = &rr_dev;
+	struct scatterlist *sg;
+	unsigned long l;
 	int i;
 
-	/* Only manage one device, refuse further probes */
-	if (dev->pdev)
-		return -EBUSY;
-	/* vendor/device and subvendor/subdevice have already been matched */
-	if (dev->devsel->bus != RR_DEVSEL_UNUSED) {
-		if (dev->devsel->bus != pdev->bus->number)
-			return -ENODEV;
-		if (dev->devsel->devfn != pdev->devfn)
-			return -ENODEV;
+	for_each_sg(sgt->sgl, sg, nents, i) {
+		l = sg_dma_len(sg);
+		if (off >= l) {
+			off -= l;
+			continue;
+		}
+		l = min(l - off, len);
+		if (todevice)
+			dma_sync_single_range_for_device(hwdev,
+							 sg_dma_address(sg),
+							 off, l,
+							 DMA_BIDIRECTIONAL);
+		else
+			dma_sync_single_range_for_cpu(hwdev,
+						      sg_dma_address(sg),
+						      off, l,
+						      DMA_BIDIRECTIONAL);
+		len -= l;
+		if (!len)
+			break;
+		off = 0;
 	}
-	/* Record the informaztion in the local structure anyways */
-	dev->devsel->subvendor = pdev->subsystem_vendor;
-	dev->devsel->subdevice = pdev->subsystem_device;
-	dev->devsel->bus = pdev->bus->number;
-	dev->devsel->devfn = pdev->devfn;
+}
 
-	/* The firmware is a module parameter, if unset use default */
-	dev->fwname = rr_fwname;
-	if (!dev->fwname[0])
-		dev->fwname = RR_DEFAULT_FWNAME;
+/* Called with the dma lock held, when the transfer is over */
+static void rr_dma_end(struct rr_dev *dev, u32 status)
+{
+	struct rr_dma *d = &dev->dma;
+
+	d->end = ktime_get();
+	d->status = status;
+	d->active = 0;
+	if (!d->todevice)
+		rr_dma_sync_range(&dev->pdev->dev, d->sgt, d->nents,
+				  d->offset, d->len, 0);
+	/* only the owner gets the result, a later transfer can't change it */
+	if (d->ctx) {
+		d->ctx->status = status;
+		d->ctx->bytes = d->bytes;
+		d->ctx->nsec = ktime_to_ns(ktime_sub(d->end, d->start));
+		d->ctx->done = 1;
+		d->ctx = NULL;
+	}
+	wake_up_all(&d->q);
+	rr_event_record(dev, RR_EVENT_DMA);
+	if (dev->stream.active) {
+		dev->stream.active = 0;
+		wake_up_interruptible(&dev->stream.q);
+	}
+}
 
-	i = pci_enable_device(pdev);
-	if (i < 0)
-	    return i;
+/*
+ * A slot of the stream is complete: start the next one, dropping the
+ * oldest slot if the reader is late (the engine can't wait)
+ */
+static void rr_stream_next(struct rr_dev *dev)
+{
+	struct rr_dma *d = &dev->dma;
+	struct rr_stream *s = &dev->stream;
+
+	rr_dma_sync_range(&dev->pdev->dev, d->sgt, d->nents, d->offset,
+			  d->len, 0);
+	s->producer++;
+	if (s->producer - s->consumer >= s->nslots) {
+		s->consumer++;
+		s->overruns++;
+	}
+	wake_up_interruptible(&s->q);
 
-	dev->pdev = pdev;
+	if (!(s->producer & (s->nslots - 1))) {
+		d->sg = d->sgt->sgl;
+		d->sgoff = 0;
+	}
+	d->offset = (s->producer & (s->nslots - 1)) * s->slotsize;
+	d->left = s->slotsize;
+	d->devaddr = s->devaddr;
+	rr_dma_program(dev);
+}
 
-	if (0) {	/* Print some information about the bars */
-		int i;
-		struct resource *r;
+/*
+ * While a transfer is running, the interrupt is used to run it, and
+ * other interrupts can't be identified (return IRQ_NONE)
+ */
+static irqreturn_t rr_dma_interrupt(struct rr_dev *dev)
+{
+	struct rr_dma *d = &dev->dma;
+	u32 stat;
 
-		for (i = 0; i < 6; i++) {
-			r = pdev->resource + i;
-			printk("%s: resource %i: %llx-%llx - %08lx\n",
-			       __func__, i,
-			       (long long)r->start,
-			       (long long)r->end, r->flags);
-		}
+	spin_lock(&d->lock);
+	if (!d->active) {
+		spin_unlock(&d->lock);
+		return IRQ_NONE;
 	}
-
-	/* Record the three bars and possibly remap them */
-	for (i = 0; i < 3; i++) {
-		struct resource *r = pdev->resource + (2 * i);
-		if (!r->start)
-			continue;
-		dev->area[i] = r;
-		if (r->flags & IORESOURCE_MEM)
-			dev->remap[i] = ioremap(r->start,
-						r->end + 1 - r->start);
+	stat = readl(dev->remap[0] + GNDMA_STAT);
+	if (stat == GNDMA_STAT_BUSY) {
+		spin_unlock(&d->lock);
+		return IRQ_NONE;
+	}
+	if (dev->remap[2]) /* the gn4124 routes the irq through gpio */
+		readl(dev->remap[2] + GNGPIO_INT_STATUS);
+	if (stat == GNDMA_STAT_DONE) {
+		d->bytes += d->curlen;
+		if (d->left)
+			rr_dma_program(dev);
+		else if (dev->stream.active)
+			rr_stream_next(dev);
+		else
+			rr_dma_end(dev, stat);
+	} else {
+		rr_dma_end(dev, stat);
 	}
+	spin_unlock(&d->lock);
+	return IRQ_HANDLED;
+}
 
-	complete(&dev->complete);
+/* Acknowledge as configured by RR_IRQACK, if the interrupt is ours */
+static irqreturn_t rr_irq_ack(struct rr_dev *dev)
+{
+	struct rr_ack *a = &dev->ack;
+	u32 stat;
+
+	smp_rmb(); /* see rr_set_irqack */
+	stat = readl(a->status);
+	if (!(stat & a->mask))
+		return IRQ_NONE;
+	if (a->flags & RR_IRQACK_STATUS)
+		writel(stat & a->mask, a->ack);
+	else if (!(a->flags & RR_IRQACK_NOWRITE))
+		writel(a->value, a->ack);
+	return IRQ_HANDLED;
+}
 
-	/* Finally, ask for a copy of the firmware for this device */
-	rr_ask_firmware(dev);
+/*
+ * Interrupt handler: unless for DMA or acknowledged in the kernel, just
+ * disable it in the controller
+ */
+irqreturn_t rr_interrupt(int irq, void *devid)
+{
+	struct rr_dev *dev = devid;
+	ktime_t stamp;
+
+	if (dev->dma.active)
+		return rr_dma_interrupt(dev);
+
+	stamp = ktime_get();
+	if (dev->ack.enabled) {
+		if (rr_irq_ack(dev) == IRQ_NONE)
+			return IRQ_NONE;
+		dev->irqstamp = stamp;
+		rr_latency_record(dev, &dev->lat->ack);
+	} else {
+		dev->irqstamp = stamp;
+		dev->flags |= RR_FLAG_IRQDISABLE;
+		disable_irq_nosync(irq);
+	}
+	dev->irqcount++;
+	rr_event_record(dev, RR_EVENT_IRQ); /* and wake up */
+	return IRQ_HANDLED;
+}
+
+/*
+ * Each vector has its own handler data. The first one behaves like the
+ * legacy interrupt, the others (MSI only) are counted and left enabled.
+ */
+static irqreturn_t rr_vector_interrupt(int irq, void *devid)
+{
+	struct rr_vector *v = devid;
+	irqreturn_t ret = IRQ_HANDLED;
+
+	if (v->nr == 0)
+		ret = rr_interrupt(irq, v->dev);
+	else
+		rr_event_record(v->dev, RR_EVENT_VECTOR + v->nr);
+	if (ret == IRQ_HANDLED) {
+		v->count++;
+		wake_up_interruptible(&v->q);
+	}
+	return ret;
+}
 
-	/* FIXME: how to know if irq is valid? */
-	if (pdev->irq > 0) {
-		i = request_irq(pdev->irq, rr_interrupt, IRQF_SHARED,
-				"rawrabbit", dev);
-		if (i < 0) {
-			printk("%s: can't request irq %i, error %i\n", __func__,
-			       pdev->irq, i);
-		} else {
-			dev->flags |= RR_FLAG_IRQREQUEST;
+/* Use MSI-X or MSI if available, or else the legacy shared line */
+static void rr_request_irqs(struct rr_dev *dev, struct pci_dev *pdev)
+{
+	struct rr_vector *v;
+	unsigned long flags = IRQF_SHARED;
+	int i, n, ret;
+
+	n = pci_alloc_irq_vectors(pdev, 1, RR_MAX_VECTORS, PCI_IRQ_ALL_TYPES);
+	if (n < 0) {
+		printk("%s: no interrupt available, error %i\n", __func__, n);
+		return;
+	}
+	if (pdev->msi_enabled || pdev->msix_enabled)
+		flags = 0; /* not shared */
+	for (i = 0; i < n; i++) {
+		v = dev->vec + i;
+		v->dev = dev;
+		v->nr = i;
+		v->irq = pci_irq_vector(pdev, i);
+		v->count = 0;
+		ret = request_irq(v->irq, rr_vector_interrupt, flags,
+				  dev->miscname, v);
+		if (ret < 0) {
+			printk("%s: can't request irq %i, error %i\n",
+			       __func__, v->irq, ret);
+			break;
 		}
+		/* Let the handler run near the board and its buffers */
+		if (dev->node != NUMA_NO_NODE)
+			irq_set_affinity_hint(v->irq,
+					      cpumask_of_node(dev->node));
+	}
+	dev->nvec = i;
+	if (!i) {
+		pci_free_irq_vectors(pdev);
+		return;
+	}
+	dev->flags |= RR_FLAG_IRQREQUEST;
+}
+
+static void rr_free_irqs(struct rr_dev *dev, struct pci_dev *pdev)
+{
+	int i;
+
+	if (!(dev->flags & RR_FLAG_IRQREQUEST))
+		return;
+	dev->ack.enabled = 0; /* the registers are going away */
+	for (i = 0; i < dev->nvec; i++) {
+		irq_set_affinity_hint(dev->vec[i].irq, NULL);
+		free_irq(dev->vec[i].irq, dev->vec + i);
 	}
+	dev->flags &= ~RR_FLAG_IRQREQUEST;
+	/* Also, reenable it, just in case we are shared.*/
+	if (dev->flags & RR_FLAG_IRQDISABLE) {
+		dev->flags &= ~RR_FLAG_IRQDISABLE;
+		enable_irq(dev->vec[0].irq);
+	}
+	pci_free_irq_vectors(pdev);
+	dev->nvec = 0;
+	for (i = 0; i < RR_MAX_VECTORS; i++) /* let RR_VECWAIT return */
+		wake_up_interruptible(&dev->vec[i].q);
+}
+
+/*
+ * Transfers with the DMA engine, started with the device mutex held.
+ * Only one transfer at a time can be running; ctx is its owner, the
+ * only one that can wait for it or abort it (NULL for the stream).
+ */
+static int rr_dma_start(struct rr_dev *dev, struct rr_dmactx *ctx,
+			struct sg_table *sgt, int nents,
+			unsigned long size, struct rr_dmareq *req)
+{
+	struct rr_dma *d = &dev->dma;
+	struct scatterlist *sg;
+	unsigned long off = req->offset;
+	int i;
 
+	if (!dev->pdev || !dev->remap[0] || !(dev->flags & RR_FLAG_IRQREQUEST))
+		return -ENODEV;
+	if (!nents)
+		return -ENODEV;
+	if ((req->offset | req->len | req->devaddr) & 3 || !req->len)
+		return -EINVAL;
+	if (req->offset >= size || req->len > size - req->offset)
+		return -EINVAL;
+	/* a pending interrupt is disabled until RR_IRQENA */
+	if (d->active || (dev->flags & RR_FLAG_IRQDISABLE))
+		return -EBUSY;
 
+	for_each_sg(sgt->sgl, sg, nents, i) {
+		if (off < sg_dma_len(sg))
+			break;
+		off -= sg_dma_len(sg);
+	}
+	if (req->flags & RR_DMA_TODEVICE)
+		rr_dma_sync_range(&dev->pdev->dev, sgt, nents, req->offset,
+				  req->len, 1);
+
+	spin_lock_irq(&d->lock);
+	d->sgt = sgt;
+	d->nents = nents;
+	d->offset = req->offset;
+	d->len = req->len;
+	d->todevice = req->flags & RR_DMA_TODEVICE;
+	d->sg = sg;
+	d->sgoff = off;
+	d->left = req->len;
+	d->devaddr = req->devaddr;
+	d->bytes = 0;
+	d->status = GNDMA_STAT_BUSY;
+	d->active = 1;
+	d->start = ktime_get();
+	d->ctx = ctx;
+	if (ctx) {
+		ctx->done = 0;
+		/* len fits the buffer size: no 64-bit division on 32-bit */
+		ctx->deadline = jiffies + RR_DMA_TIMEOUT
+			+ msecs_to_jiffies((unsigned long)req->len
+					   / (RR_DMA_MIN_RATE / 1000));
+	}
+	rr_dma_program(dev);
+	spin_unlock_irq(&d->lock);
 	return 0;
 }
 
-/* This function is called when the pcidrv is removed, with lock held */
-static void rr_pciremove(struct pci_dev *pdev)
+/* Stop the running transfer, if any, with the device mutex held */
+static void rr_dma_abort(struct rr_dev *dev)
 {
-	struct rr_dev *dev = &rr_dev;
+	struct rr_dma *d = &dev->dma;
+	unsigned long flags;
 	int i;
 
-	if (dev->flags & RR_FLAG_IRQREQUEST) {
-		free_irq(pdev->irq, dev);
-		dev->flags &= ~RR_FLAG_IRQREQUEST;
-		/* Also, reenable it, just in case we are shared.*/
-		if (dev->flags & RR_FLAG_IRQDISABLE) {
-			dev->flags &= ~RR_FLAG_IRQDISABLE;
-			enable_irq(dev->pdev->irq);
+	spin_lock_irqsave(&d->lock, flags);
+	if (d->active) {
+		writel(GNDMA_CTRL_ABORT, dev->remap[0] + GNDMA_CTRL);
+		/* don't release the buffer while the engine still uses it */
+		for (i = 0; i < 100; i++) {
+			if (readl(dev->remap[0] + GNDMA_STAT)
+			    != GNDMA_STAT_BUSY)
+				break;
+			udelay(1);
 		}
+		rr_dma_end(dev, GNDMA_STAT_ABORTED);
 	}
-	for (i = 0; i < 3; i++) {
-		iounmap(dev->remap[i]);		/* safe for NULL ptrs */
-		dev->remap[i] = NULL;
-		dev->area[i] = NULL;
+	spin_unlock_irqrestore(&d->lock, flags);
+}
+
+/*
+ * Wait for the end of the transfer of ctx, which is aborted on timeout
+ * (or signal, if intr). Transfers of other owners are left alone.
+ */
+static int rr_dma_wait(struct rr_dev *dev, struct rr_dmactx *ctx,
+		       struct rr_dmareq *req, int intr)
+{
+	struct rr_dma *d = &dev->dma;
+	long ret, left;
+
+	/* the time allowed counts from submission, also when async */
+	left = (long)(ctx->deadline - jiffies);
+	ret = wait_event_interruptible_timeout(d->q, ctx->done,
+					       max(left, 0L));
+	if (ret == 0 || (ret < 0 && intr)) {
+		mutex_lock(&dev->mutex);
+		if (d->ctx == ctx)
+			rr_dma_abort(dev);
+		mutex_unlock(&dev->mutex);
+		return ret ? -EINTR : -ETIMEDOUT;
 	}
-	release_firmware(dev->fw);
-	dev->fw = NULL;
-	dev->pdev = NULL;
+	if (ret < 0)
+		return ret;
+
+	spin_lock_irq(&d->lock);
+	req->status = ctx->status;
+	req->bytes = ctx->bytes;
+	req->nsec = ctx->nsec;
+	spin_unlock_irq(&d->lock);
+	return req->status == GNDMA_STAT_DONE ? 0 : -EIO;
 }
 
-static struct pci_driver rr_pcidrv = {
-	.name = "rawrabbit",
-	.id_table = rr_idtable,
-	.probe = rr_pciprobe,
-	.remove = rr_pciremove,
-};
+/*
+ * We have a PCI driver, used to access the BAR areas.
+ * One device id only is supported. 
+ */
 
-/* There is only one device by now; I didn't find how to associate to pcidev */
-static struct rr_devsel rr_devsel;
-/* The device can't be static. I need it in the module parameter */
-struct rr_dev rr_dev = {
-	.pci_driver = &rr_pcidrv,
-	.id_table = rr_idtable,
-	.q = __WAIT_QUEUE_HEAD_INITIALIZER(rr_dev.q),
-	.mutex = __MUTEX_INITIALIZER(rr_dev.mutex),
-	.devsel = &rr_devsel,
-	.work = __WORK_INITIALIZER(rr_dev.work, rr_load_firmware),
-};
+static struct pci_device_id rr_idtable[2]; /* last must be zero */
+
+static void rr_fill_table(void)
+{
+	if (rr_devsel.subvendor == RR_DEVSEL_UNUSED) {
+		rr_idtable->subvendor = PCI_ANY_ID;
+		rr_idtable->subdevice = PCI_ANY_ID;
+	} else {
+		rr_idtable->subvendor = rr_devsel.subvendor;
+		rr_idtable->subdevice = rr_devsel.subdevice;
+	}
+	rr_idtable->vendor = rr_devsel.vendor;
+	rr_idtable->device = rr_devsel.device;
+}
+
+static int rr_fill_table_and_probe(void)
+{
+	int ret;
 
+	/* Only at init time: RR_DEVSEL adds dynamic ids instead */
+	rr_fill_table();
+
+	/* Use the completion mechanism to be notified of probes */
+	ret = pci_register_driver(&rr_pcidrv);
+	if (ret < 0) {
+		printk(KERN_ERR "%s: Can't register pci driver\n",
+		       KBUILD_MODNAME);
+		return ret;
+	}
+	/* This ret is 0 (timeout) or positive */
+	ret = wait_for_completion_timeout(&rr_probe_done, RR_PROBE_TIMEOUT);
+	if (!ret) {
+		printk("%s: Warning: no device found\n", __func__);
+	}
+	return ret;
+}
 
 /*
- * These functions are (inlined) helpers for ioctl
+ * DMA buffers are mapped for the bound device with the streaming DMA
+ * API, so the bus addresses are correct even behind an IOMMU.
+ * This returns the number of segments, or a negative error.
  */
-static int rr_do_read_mem(struct rr_dev *dev, struct rr_iocmd *iocmd)
+static int __rr_dma_map_sgt(struct pci_dev *pdev, struct sg_table *sgt)
 {
-	int bar = __RR_GET_BAR(iocmd->address) / 2;
-	int off = __RR_GET_OFF(iocmd->address);
-	struct resource *r = dev->area[bar];
+	int ret;
 
-	if (off >= r->end - r->start + 1)
-		return -ENOMEDIUM;
+	if (dma_set_mask(&pdev->dev, DMA_BIT_MASK(64))
+	    && dma_set_mask(&pdev->dev, DMA_BIT_MASK(32)))
+		goto err;
+	ret = dma_map_sg(&pdev->dev, sgt->sgl, sgt->orig_nents,
+			 DMA_BIDIRECTIONAL);
+	if (!ret)
+		goto err;
+	pci_set_master(pdev);
+	return ret;
+ err:
+	sg_free_table(sgt);
+	return -EIO;
+}
 
-	switch(iocmd->datasize) {
-	case 1:
-		iocmd->data8 = readb(dev->remap[bar] + off);
-		break;
-	case 2:
-		if (off & 1)
-			return -EIO;
-		iocmd->data16 = readw(dev->remap[bar] + off);
-		break;
-	case 4:
-		if (off & 3)
-			return -EIO;
-		iocmd->data32 = readl(dev->remap[bar] + off);
-		break;
-	case 8:
-		if (off & 7)
-			return -EIO;
-		iocmd->data64 = readq(dev->remap[bar] + off);
-		break;
-	default:
+/*
+ * The pages of a vmalloc buffer, merged in segments of up to maxseg
+ * bytes where they are contiguous in RAM, as with huge pages
+ */
+static int __rr_dma_table(void *buf, unsigned long size, unsigned int maxseg,
+			  struct sg_table *sgt)
+{
+	struct scatterlist *sg = NULL;
+	unsigned long off, pfn, next = 0, len = 0;
+	int ret, nents = 0;
+
+	maxseg = max_t(unsigned int, maxseg & PAGE_MASK, PAGE_SIZE);
+	/* count the segments first, then fill them */
+	for (off = 0; off < size; off += PAGE_SIZE) {
+		pfn = vmalloc_to_pfn(buf + off);
+		if (!off || pfn != next || len == maxseg) {
+			nents++;
+			len = 0;
+		}
+		len += PAGE_SIZE;
+		next = pfn + 1;
+	}
+	ret = sg_alloc_table(sgt, nents, GFP_KERNEL);
+	if (ret)
+		return ret;
+	for (off = 0; off < size; off += PAGE_SIZE) {
+		pfn = vmalloc_to_pfn(buf + off);
+		if (!off || pfn != next || sg->length == maxseg) {
+			sg = sg ? sg_next(sg) : sgt->sgl;
+			sg_set_page(sg, pfn_to_page(pfn), 0, 0);
+		}
+		sg->length += PAGE_SIZE;
+		next = pfn + 1;
+	}
+	return 0;
+}
+
+static int __rr_dma_map(struct pci_dev *pdev, void *buf, unsigned long size,
+			struct sg_table *sgt)
+{
+	int ret = __rr_dma_table(buf, size, dma_get_max_seg_size(&pdev->dev),
+				 sgt);
+
+	if (ret)
+		return ret;
+	return __rr_dma_map_sgt(pdev, sgt);
+}
+
+static void __rr_dma_unmap(struct pci_dev *pdev, struct sg_table *sgt)
+{
+	dma_unmap_sg(&pdev->dev, sgt->sgl, sgt->orig_nents,
+		     DMA_BIDIRECTIONAL);
+	sg_free_table(sgt);
+}
+
+static int rr_dma_map(struct rr_dev *dev, struct pci_dev *pdev)
+{
+	int ret = __rr_dma_map(pdev, dev->dmabuf, dev->bufsize, &dev->sgt);
+
+	if (ret < 0)
+		return ret;
+	dev->dma_nents = ret;
+	return 0;
+}
+
+static void rr_dma_unmap(struct rr_dev *dev, struct pci_dev *pdev)
+{
+	if (!dev->dma_nents)
+		return;
+	__rr_dma_unmap(pdev, &dev->sgt);
+	dev->dma_nents = 0;
+}
+
+/*
+ * Same for the buffers of each file, with the device mutex held.
+ * Pinned user pages are merged in segments where contiguous.
+ */
+static int rr_buf_map(struct rr_buf *b, struct pci_dev *pdev)
+{
+	int ret;
+
+	if (b->pages) {
+		ret = sg_alloc_table_from_pages(&b->sgt, b->pages, b->npages,
+						b->offset, b->size,
+						GFP_KERNEL);
+		if (!ret)
+			ret = __rr_dma_map_sgt(pdev, &b->sgt);
+	} else {
+		ret = __rr_dma_map(pdev, b->addr, b->size, &b->sgt);
+	}
+	if (ret < 0)
+		return ret;
+	b->nents = ret;
+	return 0;
+}
+
+static void rr_buf_unmap(struct rr_buf *b, struct pci_dev *pdev)
+{
+	if (!b->nents)
+		return;
+	__rr_dma_unmap(pdev, &b->sgt);
+	b->nents = 0;
+}
+
+/*
+ * Buffers are vmalloc memory, zeroed. With rr_hugebuf, they are built
+ * from 2MB blocks where possible (smaller ones otherwise) and mapped
+ * by vmap, so the device gets few long segments. The blocks are split
+ * in normal pages, so vmalloc_to_page and mmap work as usual, and the
+ * page array is returned for rr_buf_vfree. It is NULL for vzalloc.
+ */
+static void *rr_buf_vzalloc(unsigned long size, int node,
+			    struct page ***vpages)
+{
+	unsigned long i = 0, j, npages = size >> PAGE_SHIFT;
+	unsigned int order = get_order(2 << 20);
+	struct page **pages, *page;
+	void *addr;
+
+	*vpages = NULL;
+	if (!rr_hugebuf)
+		return vzalloc_node(size, node);
+	pages = vmalloc(npages * sizeof(*pages));
+	if (!pages)
+		return vzalloc_node(size, node);
+	while (i < npages) {
+		order = min_t(unsigned int, order, ilog2(npages - i));
+		page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO
+					| __GFP_NOWARN | __GFP_NORETRY, order);
+		if (!page) {
+			if (!order)
+				goto err;
+			order--;
+			continue;
+		}
+		split_page(page, order);
+		for (j = 0; j < (1UL << order); j++)
+			pages[i++] = page + j;
+	}
+	addr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	if (addr) {
+		*vpages = pages;
+		return addr;
+	}
+ err:
+	while (i)
+		__free_page(pages[--i]);
+	vfree(pages);
+	return vzalloc_node(size, node);
+}
+
+static void rr_buf_vfree(void *addr, struct page **vpages, unsigned long size)
+{
+	unsigned long i;
+
+	if (!vpages) {
+		vfree(addr);
+		return;
+	}
+	vunmap(addr);
+	for (i = 0; i < size >> PAGE_SHIFT; i++)
+		__free_page(vpages[i]); /* user mappings hold their own ref */
+	vfree(vpages);
+}
+
+/*
+ * Allocate and initialize a device structure, with no board yet.
+ * Memory comes from the node of the board, as the handler and DMA use it.
+ */
+static struct rr_dev *rr_dev_alloc(int node)
+{
+	struct rr_dev *dev;
+	int i;
+
+	dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, node);
+	if (!dev)
+		return NULL;
+	dev->node = node;
+	/* The size can be changed later, with RR_SETDMASIZE */
+	dev->bufsize = PAGE_ALIGN(rr_bufsize);
+	dev->dmabuf = rr_buf_vzalloc(dev->bufsize, node, &dev->vpages);
+	dev->events = kzalloc_node(RR_NEVENTS * sizeof(*dev->events),
+				   GFP_KERNEL, node);
+	dev->lat = kzalloc_node(sizeof(*dev->lat), GFP_KERNEL, node);
+	if (!dev->dmabuf || !dev->events || !dev->lat)
+		goto out;
+	if (init_srcu_struct(&dev->srcu) < 0)
+		goto out;
+
+	dev->pci_driver = &rr_pcidrv;
+	dev->id_table = rr_idtable;
+	dev->devsel = &rr_devsel;
+	kref_init(&dev->kref);
+	mutex_init(&dev->mutex);
+	init_waitqueue_head(&dev->q);
+	INIT_WORK(&dev->work, rr_load_firmware);
+	INIT_LIST_HEAD(&dev->list);
+	INIT_LIST_HEAD(&dev->bufs);
+	spin_lock_init(&dev->dma.lock);
+	init_waitqueue_head(&dev->dma.q);
+	mutex_init(&dev->stream.mutex);
+	init_waitqueue_head(&dev->stream.q);
+	spin_lock_init(&dev->evlock);
+	INIT_LIST_HEAD(&dev->evfiles);
+	for (i = 0; i < RR_MAX_VECTORS; i++)
+		init_waitqueue_head(&dev->vec[i].q);
+	hrtimer_setup(&dev->mod.timer, rr_mod_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+	return dev;
+
+ out:
+	kfree(dev->lat);
+	kfree(dev->events);
+	rr_buf_vfree(dev->dmabuf, dev->vpages, dev->bufsize);
+	kfree(dev);
+	return NULL;
+}
+
+/* The board (if any) is gone and no file refers to the device any more */
+static void rr_dev_release(struct kref *kref)
+{
+	struct rr_dev *dev = container_of(kref, struct rr_dev, kref);
+
+	hrtimer_cancel(&dev->mod.timer);
+	cleanup_srcu_struct(&dev->srcu);
+	kfree(dev->lat);
+	kfree(dev->events);
+	rr_buf_vfree(dev->dmabuf, dev->vpages, dev->bufsize);
+	kfree(dev);
+}
+
+static void rr_dev_put(struct rr_dev *dev)
+{
+	kref_put(&dev->kref, rr_dev_release);
+}
+
+/* Attributes of the misc device of each board, in /sys/class/misc */
+static ssize_t numa_node_show(struct device *d, struct device_attribute *attr,
+			      char *buf)
+{
+	struct miscdevice *misc = dev_get_drvdata(d);
+	struct rr_dev *dev = container_of(misc, struct rr_dev, misc);
+
+	return sprintf(buf, "%i\n", dev->node);
+}
+static DEVICE_ATTR_RO(numa_node);
+
+static struct attribute *rr_attrs[] = {
+	&dev_attr_numa_node.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(rr);
+
+/* Whether a board matches a selection, as passed to RR_DEVSEL */
+static int rr_devsel_match(struct rr_devsel *sel, struct pci_dev *pdev)
+{
+	if (sel->vendor != pdev->vendor || sel->device != pdev->device)
+		return 0;
+	if (sel->subvendor != RR_DEVSEL_UNUSED
+	    && (sel->subvendor != pdev->subsystem_vendor
+		|| sel->subdevice != pdev->subsystem_device))
+		return 0;
+	if (sel->bus != RR_DEVSEL_UNUSED
+	    && (sel->bus != pdev->bus->number || sel->devfn != pdev->devfn))
+		return 0;
+	return 1;
+}
+
+/* The probe and remove function can't get locks, as it's already locked */
+static int rr_pciprobe (struct pci_dev *pdev, const struct pci_device_id *id)
+{
+	struct rr_dev *dev;
+	int i;
+
+	dev = rr_dev_alloc(dev_to_node(&pdev->dev));
+	if (!dev)
+		return -ENOMEM;
+	snprintf(dev->miscname, sizeof(dev->miscname), "rawrabbit-%04x-%04x",
+		 pdev->bus->number, pdev->devfn);
+
+	/* The firmware is a module parameter, if unset use default */
+	dev->fwname = rr_fwname;
+	if (!dev->fwname[0])
+		dev->fwname = RR_DEFAULT_FWNAME;
+
+	i = pci_enable_device(pdev);
+	if (i < 0) {
+		rr_dev_put(dev);
+		return i;
+	}
+	/* The DMA engine takes 32-bit lengths, so segments can be long */
+	dma_set_max_seg_size(&pdev->dev, UINT_MAX);
+
+	if (0) {	/* Print some information about the bars */
+		int i;
+		struct resource *r;
+
+		for (i = 0; i < 6; i++) {
+			r = pdev->resource + i;
+			printk("%s: resource %i: %llx-%llx - %08lx\n",
+			       __func__, i,
+			       (long long)r->start,
+			       (long long)r->end, r->flags);
+		}
+	}
+
+	/* Record the three bars and possibly remap them */
+	for (i = 0; i < 3; i++) {
+		struct resource *r = pdev->resource + (2 * i);
+		if (!r->start)
+			continue;
+		dev->area[i] = r;
+		if (r->flags & IORESOURCE_MEM)
+			dev->remap[i] = ioremap(r->start,
+						r->end + 1 - r->start);
+	}
+
+	i = rr_dma_map(dev, pdev);
+	if (i < 0)
+		printk(KERN_WARNING "%s: can't map DMA buffer, error %i\n",
+		       __func__, i);
+
+	/* Publish the device only now, as register access is lockless */
+	rcu_assign_pointer(dev->pdev, pdev);
+	pci_set_drvdata(pdev, dev);
+
+	mutex_lock(&rr_boards_mutex);
+	list_add_tail(&dev->list, &rr_boards);
+	if (!rr_selected && rr_devsel_match(&rr_devsel, pdev)) {
+		rr_selected = dev;
+		/* Record the information in the local structure anyways */
+		rr_devsel.subvendor = pdev->subsystem_vendor;
+		rr_devsel.subdevice = pdev->subsystem_device;
+		rr_devsel.bus = pdev->bus->number;
+		rr_devsel.devfn = pdev->devfn;
+		complete(&rr_probe_done);
+	}
+	mutex_unlock(&rr_boards_mutex);
+
+	/* Finally, ask for a copy of the firmware for this device */
+	rr_ask_firmware(dev);
+
+	rr_request_irqs(dev, pdev);
+
+	/* A failure here is not fatal, as /dev/rawrabbit can reach us */
+	dev->misc.minor = MISC_DYNAMIC_MINOR;
+	dev->misc.name = dev->miscname;
+	dev->misc.fops = &rr_fops;
+	dev->misc.parent = &pdev->dev;
+	dev->misc.groups = rr_groups;
+	i = misc_register(&dev->misc);
+	if (i < 0)
+		printk(KERN_ERR "%s: Can't register misc device %s\n",
+		       KBUILD_MODNAME, dev->miscname);
+	else
+		dev->flags |= RR_FLAG_MISC;
+
+	return 0;
+}
+
+/* This function is called when the pcidrv is removed, with lock held */
+static void rr_pciremove(struct pci_dev *pdev)
+{
+	struct rr_dev *dev = pci_get_drvdata(pdev);
+	struct rr_buf *b;
+	int i;
+
+	/* No more opens of this board, neither direct nor by selection */
+	if (dev->flags & RR_FLAG_MISC)
+		misc_deregister(&dev->misc);
+	mutex_lock(&rr_boards_mutex);
+	list_del_init(&dev->list); /* so RR_DEVSEL knows it's gone */
+	if (rr_selected == dev)
+		rr_selected = NULL;
+	mutex_unlock(&rr_boards_mutex);
+	flush_work(&dev->work); /* the loader uses the BARs */
+
+	/*
+	 * Open files may still use the device: the mutex protects the
+	 * buffer lists and mappings. Then stop lockless register access
+	 * before unmapping (rr_do_iocmd); SRCU readers never take the mutex
+	 */
+	mutex_lock(&dev->mutex);
+	rr_dma_abort(dev);
+	rcu_assign_pointer(dev->pdev, NULL);
+	synchronize_srcu(&dev->srcu);
+
+	/* user mappings of the BARs can't fault in again: zap them */
+	mutex_lock(&rr_inode_mutex);
+	if (rr_inode)
+		unmap_mapping_range(rr_inode->i_mapping, 0, RR_BAR_BUF, 1);
+	mutex_unlock(&rr_inode_mutex);
+
+	rr_free_irqs(dev, pdev);
+	rr_dma_unmap(dev, pdev);
+	list_for_each_entry(b, &dev->bufs, devlist)
+		rr_buf_unmap(b, pdev);
+	for (i = 0; i < 3; i++) {
+		iounmap(dev->remap[i]);		/* safe for NULL ptrs */
+		dev->remap[i] = NULL;
+		dev->area[i] = NULL;
+	}
+	mutex_unlock(&dev->mutex);
+	release_firmware(dev->fw);
+	dev->fw = NULL;
+	pci_set_drvdata(pdev, NULL);
+	rr_dev_put(dev); /* open files may still refer to it */
+}
+
+static struct pci_driver rr_pcidrv = {
+	.name = "rawrabbit",
+	.id_table = rr_idtable,
+	.probe = rr_pciprobe,
+	.remove = rr_pciremove,
+};
+
+
+/*
+ * These functions are (inlined) helpers for ioctl
+ */
+static int rr_do_read_mem(struct rr_dev *dev, struct rr_iocmd *iocmd)
+{
+	int bar = __RR_GET_BAR(iocmd->address) / 2;
+	int off = __RR_GET_OFF(iocmd->address);
+	struct resource *r = dev->area[bar];
+
+	if (off >= r->end - r->start + 1)
+		return -ENOMEDIUM;
+
+	switch(iocmd->datasize) {
+	case 1:
+		iocmd->data8 = readb(dev->remap[bar] + off);
+		break;
+	case 2:
+		if (off & 1)
+			return -EIO;
+		iocmd->data16 = readw(dev->remap[bar] + off);
+		break;
+	case 4:
+		if (off & 3)
+			return -EIO;
+		iocmd->data32 = readl(dev->remap[bar] + off);
+		break;
+	case 8:
+		if (off & 7)
+			return -EIO;
+		iocmd->data64 = readq(dev->remap[bar] + off);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int rr_do_write_mem(struct rr_dev *dev, struct rr_iocmd *iocmd)
+{
+	int bar = __RR_GET_BAR(iocmd->address) / 2;
+	int off = __RR_GET_OFF(iocmd->address);
+	struct resource *r = dev->area[bar];
+
+	if (off >= r->end - r->start + 1)
+		return -ENOMEDIUM;
+
+	switch(iocmd->datasize) {
+	case 1:
+		writeb(iocmd->data8, dev->remap[bar] + off);
+		break;
+	case 2:
+		if (off & 1)
+			return -EIO;
+		writew(iocmd->data16, dev->remap[bar] + off);
+		break;
+	case 4:
+		if (off & 3)
+			return -EIO;
+		writel(iocmd->data32, dev->remap[bar] + off);
+		break;
+	case 8:
+		if (off & 7)
+			return -EIO;
+		writeq(iocmd->data64, dev->remap[bar] + off);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int rr_do_read_io(struct rr_dev *dev, struct rr_iocmd *iocmd)
+{
+	int bar = __RR_GET_BAR(iocmd->address) / 2;
+	int off = __RR_GET_OFF(iocmd->address);
+	struct resource *r = dev->area[bar];
+
+	if (off >= r->end - r->start + 1)
+		return -ENOMEDIUM;
+
+	switch(iocmd->datasize) {
+	case 1:
+		iocmd->data8 = inb(r->start + off);
+		break;
+	case 2:
+		if (off & 1)
+			return -EIO;
+		iocmd->data16 = inw(r->start + off);
+		break;
+	case 4:
+		if (off & 3)
+			return -EIO;
+		iocmd->data32 = inl(r->start + off);
+		break;
+	case 8:
+		if (off & 7)
+			return -EIO;
+		/* assume little-endian bus */
+		iocmd->data64 = inl(r->start + off);
+		iocmd->data64 |= (__u64)(inl(r->start + off + 4)) << 32;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int rr_do_write_io(struct rr_dev *dev, struct rr_iocmd *iocmd)
+{
+	int bar = __RR_GET_BAR(iocmd->address) / 2 ;
+	int off = __RR_GET_OFF(iocmd->address);
+	struct resource *r = dev->area[bar];
+
+	if (off >= r->end - r->start + 1)
+		return -ENOMEDIUM;
+
+	switch(iocmd->datasize) {
+	case 1:
+		outb(iocmd->data8,  r->start + off);
+		break;
+	case 2:
+		if (off & 1)
+			return -EIO;
+		outw(iocmd->data16, r->start + off);
+		break;
+	case 4:
+		if (off & 3)
+			return -EIO;
+		outl(iocmd->data32, r->start + off);
+		break;
+	case 8:
+		if (off & 7)
+			return -EIO;
+		/* assume little-endian bus */
+		outl(iocmd->data64, r->start + off);
+		outl(iocmd->data64 >> 32, r->start + off + 4);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * The buffer can be resized under lockless readers: they must read the
+ * size before the pointer, see rr_do_setdmasize() for the other side.
+ */
+static inline void *rr_get_dmabuf(struct rr_dev *dev, unsigned long *size)
+{
+	*size = dev->bufsize;
+	smp_rmb();
+	return dev->dmabuf;
+}
+
+/* This helper is called for dmabuf operations */
+static int rr_do_iocmd_dmabuf(struct rr_dev *dev, unsigned int cmd,
+		       struct rr_iocmd *iocmd)
+{
+	int off = __RR_GET_OFF(iocmd->address);
+	unsigned long size;
+	void *buf = rr_get_dmabuf(dev, &size);
+
+	if (off >= size)
+		return -ENOMEDIUM;
+
+	switch(iocmd->datasize) {
+	case 1:
+		if (cmd == RR_WRITE)
+			*(u8 *)(buf + off) = iocmd->data8;
+		else
+			iocmd->data8 = *(u8 *)(buf + off);
+		break;
+	case 2:
+		if (off & 1)
+			return -EIO;
+		if (cmd == RR_WRITE)
+			*(u16 *)(buf + off) = iocmd->data16;
+		else
+			iocmd->data16 = *(u16 *)(buf + off);
+		break;
+	case 4:
+		if (off & 3)
+			return -EIO;
+		if (cmd == RR_WRITE)
+			*(u32 *)(buf + off) = iocmd->data32;
+		else
+			iocmd->data32 = *(u32 *)(buf + off);
+		break;
+	case 8:
+		if (off & 7)
+			return -EIO;
+		if (cmd == RR_WRITE)
+			*(u64 *)(buf + off) = iocmd->data64;
+		else
+			iocmd->data64 = *(u64 *)(buf + off);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int __rr_do_iocmd(struct rr_dev *dev, unsigned int cmd,
+			 struct rr_iocmd *iocmd)
+{
+	int bar;
+	unsigned off;
+	struct resource *r;
+
+	bar = __RR_GET_BAR(iocmd->address);
+	off = __RR_GET_OFF(iocmd->address);
+
+	if (!rr_is_valid_bar(iocmd->address))
+		return -EINVAL;
+
+	if (rr_is_dmabuf_bar(iocmd->address))
+		return rr_do_iocmd_dmabuf(dev, cmd, iocmd);
+
+	if (!srcu_dereference(dev->pdev, &dev->srcu))
+		return -ENODEV;		/* unbound, or being unbound */
+	bar /= 2;			/* use 0,1,2 as index */
+	r = dev->area[bar];
+
+	if (!r)
+		return -ENODEV;
+
+	if (likely(r->flags & IORESOURCE_MEM)) {
+		if (cmd == RR_READ)
+			return rr_do_read_mem(dev, iocmd);
+		else
+			return rr_do_write_mem(dev, iocmd);
+	}
+	if (likely(r->flags & IORESOURCE_IO)) {
+		if (cmd == RR_READ)
+			return rr_do_read_io(dev, iocmd);
+		else
+			return rr_do_write_io(dev, iocmd);
+	}
+	return -EIO;
+}
+
+/*
+ * Register access doesn't take the mutex, so concurrent users don't
+ * serialize. Unbinding clears dev->pdev and then waits for all SRCU
+ * readers, before unmapping the BARs.
+ */
+static int rr_do_iocmd(struct rr_dev *dev, unsigned int cmd,
+		       struct rr_iocmd *iocmd)
+{
+	int idx, ret;
+
+	idx = srcu_read_lock(&dev->srcu);
+	ret = __rr_do_iocmd(dev, cmd, iocmd);
+	srcu_read_unlock(&dev->srcu, idx);
+	return ret;
+}
+
+/*
+ * Vectored access: run all commands through rr_do_iocmd(), with a
+ * single system call. The return value is the number of failed
+ * commands, whose error is reported in the status array.
+ */
+static int rr_do_iov(struct rr_dev *dev, struct rr_iov *iov)
+{
+	struct rr_iocmd __user *ucmd = (void __user *)(long)iov->iocmd;
+	s32 __user *ustatus = (void __user *)(long)iov->status;
+	struct rr_iocmd *kcmd;
+	s32 *kstatus;
+	unsigned int i, n, done;
+	int errors = 0;
+
+	if (iov->cmd != RR_READ && iov->cmd != RR_WRITE)
+		return -EINVAL;
+	kcmd = kmalloc(RR_IOV_CHUNK * (sizeof(*kcmd) + sizeof(*kstatus)),
+		       GFP_KERNEL);
+	if (!kcmd)
+		return -ENOMEM;
+	kstatus = (s32 *)(kcmd + RR_IOV_CHUNK);
+
+	for (done = 0; done < iov->nr; done += n) {
+		n = min_t(unsigned int, iov->nr - done, RR_IOV_CHUNK);
+		if (copy_from_user(kcmd, ucmd + done, n * sizeof(*kcmd))) {
+			errors = -EFAULT;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			kstatus[i] = rr_do_iocmd(dev, iov->cmd, kcmd + i);
+			if (kstatus[i])
+				errors++;
+		}
+		if (iov->cmd == RR_READ
+		    && copy_to_user(ucmd + done, kcmd, n * sizeof(*kcmd))) {
+			errors = -EFAULT;
+			break;
+		}
+		if (ustatus
+		    && copy_to_user(ustatus + done, kstatus,
+				    n * sizeof(*kstatus))) {
+			errors = -EFAULT;
+			break;
+		}
+	}
+	kfree(kcmd);
+	return errors;
+}
+
+/*
+ * Run a sequence of register operations, under the lock already taken
+ * by the caller. On error, seq->done tells which operation failed.
+ */
+static int rr_do_seq(struct rr_dev *dev, struct rr_seq *seq)
+{
+	struct rr_seqop *ops, *op;
+	struct rr_iocmd iocmd;
+	unsigned int skip;
+	u64 delay = 0;
+	u32 *values;
+	int ret = 0, match;
+
+	seq->done = seq->collected = 0;
+	if (seq->nops > RR_SEQ_MAX_OPS)
+		return -E2BIG;
+	if (seq->nvalues > seq->nops)
+		seq->nvalues = seq->nops; /* can't collect more than that */
+	ops = kmalloc(seq->nops * (sizeof(*ops) + sizeof(*values)),
+		      GFP_KERNEL);
+	if (!ops)
+		return -ENOMEM;
+	values = (u32 *)(ops + seq->nops);
+	if (copy_from_user(ops, (void __user *)(long)seq->ops,
+			   seq->nops * sizeof(*ops))) {
+		kfree(ops);
+		return -EFAULT;
+	}
+	/* the device lock is held throughout: limit the sum of delays */
+	for (op = ops; op < ops + seq->nops; op++)
+		if (op->op == RR_SEQ_DELAY)
+			delay += op->value;
+	if (delay > RR_SEQ_MAX_TOTAL_DELAY) {
+		kfree(ops);
+		return -EINVAL;
+	}
+
+	iocmd.datasize = 4;
+	for (op = ops; op < ops + seq->nops; op++, seq->done++) {
+		iocmd.address = op->address;
+		if (op->op != RR_SEQ_WRITE && op->op != RR_SEQ_DELAY) {
+			/* all others start by reading the register */
+			ret = rr_do_iocmd(dev, RR_READ, &iocmd);
+			if (ret)
+				break;
+		}
+		switch(op->op) {
+		case RR_SEQ_READ:
+			if (seq->collected == seq->nvalues) {
+				ret = -ENOSPC;
+				break;
+			}
+			values[seq->collected++] = iocmd.data32;
+			break;
+		case RR_SEQ_WRITE:
+			iocmd.data32 = op->value;
+			ret = rr_do_iocmd(dev, RR_WRITE, &iocmd);
+			break;
+		case RR_SEQ_RMW:
+			iocmd.data32 &= ~op->mask;
+			iocmd.data32 |= op->value & op->mask;
+			ret = rr_do_iocmd(dev, RR_WRITE, &iocmd);
+			break;
+		case RR_SEQ_DELAY:
+			if (op->value > RR_SEQ_MAX_DELAY)
+				ret = -EINVAL;
+			else if (op->value < 1000)
+				udelay(op->value);
+			else
+				msleep(op->value / 1000);
+			break;
+		case RR_SEQ_SKIPEQ:
+		case RR_SEQ_SKIPNE:
+			match = (iocmd.data32 & op->mask) == op->value;
+			if (op->op == RR_SEQ_SKIPNE)
+				match = !match;
+			if (!match)
+				break;
+			/* skipped operations are counted as done */
+			skip = op->skip;
+			if (skip > ops + seq->nops - op - 1) {
+				ret = -EINVAL;
+				break;
+			}
+			op += skip;
+			seq->done += skip;
+			break;
+		default:
+			ret = -EINVAL;
+		}
+		if (ret)
+			break;
+	}
+
+	if (seq->collected
+	    && copy_to_user((void __user *)(long)seq->values, values,
+			    seq->collected * sizeof(*values)))
+		ret = -EFAULT;
+	kfree(ops);
+	return ret;
+}
+
+/*
+ * Reallocate the DMA buffer, with the lock held. Lockless readers (see
+ * rr_get_dmabuf) are first shown a zero size and then waited for.
+ */
+static int rr_do_setdmasize(struct rr_dev *dev, unsigned long size)
+{
+	struct pci_dev *pdev = dev->pdev;
+	struct page **newpages, **oldpages;
+	unsigned long oldsize;
+	void *new, *old;
+	int ret;
+
+	size = PAGE_ALIGN(size);
+	if (!size || size > INT_MAX)
+		return -EINVAL;
+	if (dev->usecount > 1 || atomic_read(&dev->dmabuf_maps)
+	    || atomic_read(&dev->dmabuf_exports) || dev->dma.active)
+		return -EBUSY;
+	new = rr_buf_vzalloc(size, dev->node, &newpages);
+	if (!new)
+		return -ENOMEM;
+
+	old = dev->dmabuf;
+	oldpages = dev->vpages;
+	oldsize = dev->bufsize;
+	dev->bufsize = 0;
+	synchronize_srcu(&dev->srcu);
+	if (pdev)
+		rr_dma_unmap(dev, pdev);
+	dev->dmabuf = new;
+	dev->vpages = newpages;
+	smp_wmb();
+	dev->bufsize = size;
+	rr_buf_vfree(old, oldpages, oldsize);
+
+	if (pdev) {
+		ret = rr_dma_map(dev, pdev);
+		if (ret < 0)
+			printk(KERN_WARNING "%s: can't map DMA buffer, "
+			       "error %i\n", __func__, ret);
+	}
+	return size;
+}
+
+/* Return part of the list of DMA segments; the caller has the lock */
+static int rr_do_getdmalist(struct sg_table *sgt, int nents,
+			    struct rr_dmalist *list)
+{
+	struct rr_dmaseg __user *useg = (void __user *)(long)list->segs;
+	struct rr_dmaseg seg;
+	struct scatterlist *sg;
+	int i, n = 0;
+
+	if (!nents)
+		return -ENODEV;
+	list->total = nents;
+	for_each_sg(sgt->sgl, sg, nents, i) {
+		if (i < list->first)
+			continue;
+		if (n == list->nseg)
+			break;
+		seg.addr = sg_dma_address(sg);
+		seg.len = sg_dma_len(sg);
+		if (copy_to_user(useg + n, &seg, sizeof(seg)))
+			return -EFAULT;
+		n++;
+	}
+	list->nseg = n;
+	return 0;
+}
+
+static int rr_dma_sync(struct pci_dev *pdev, struct sg_table *sgt, int nents,
+		       unsigned long dir)
+{
+	if (!nents)
+		return -ENODEV;
+	if (dir == RR_DMASYNC_CPU)
+		dma_sync_sg_for_cpu(&pdev->dev, sgt->sgl, sgt->orig_nents,
+				    DMA_BIDIRECTIONAL);
+	else if (dir == RR_DMASYNC_DEVICE)
+		dma_sync_sg_for_device(&pdev->dev, sgt->sgl, sgt->orig_nents,
+				       DMA_BIDIRECTIONAL);
+	else
+		return -EINVAL;
+	return 0;
+}
+
+/* Streaming, started and stopped with the device mutex held */
+static int rr_stream_start(struct rr_dev *dev, struct rr_streamreq *req)
+{
+	struct rr_stream *s = &dev->stream;
+	struct rr_dmareq dreq;
+	int ret;
+
+	if (!req->slotsize || (req->slotsize & 3)
+	    || !is_power_of_2(req->nslots))
+		return -EINVAL;
+	if ((u64)req->slotsize * req->nslots > dev->bufsize)
+		return -EINVAL;
+	if (dev->dma.active)
+		return -EBUSY;
+
+	/* no reader is sleeping, as the stream is not active */
+	mutex_lock(&s->mutex);
+	s->slotsize = req->slotsize;
+	s->nslots = req->nslots;
+	s->devaddr = req->devaddr;
+	s->producer = s->consumer = s->overruns = 0;
+	s->active = 1;
+
+	memset(&dreq, 0, sizeof(dreq));
+	dreq.len = s->slotsize;
+	dreq.devaddr = s->devaddr;
+	ret = rr_dma_start(dev, NULL, &dev->sgt, dev->dma_nents, dev->bufsize,
+			   &dreq);
+	if (ret < 0)
+		s->active = 0;
+	mutex_unlock(&s->mutex);
+	return ret;
+}
+
+static void rr_stream_stat(struct rr_dev *dev, struct rr_streamreq *req)
+{
+	struct rr_stream *s = &dev->stream;
+
+	spin_lock_irq(&dev->dma.lock);
+	req->slotsize = s->slotsize;
+	req->nslots = s->nslots;
+	req->devaddr = s->devaddr;
+	req->flags = s->active ? RR_STREAM_ACTIVE : 0;
+	req->produced = s->producer;
+	req->consumed = s->consumer;
+	req->overruns = s->overruns;
+	spin_unlock_irq(&dev->dma.lock);
+}
+
+/*
+ * Buffers owned by a file. The list is protected by the file lock, and
+ * the device mutex is also taken to change the device list or the mapping
+ */
+static struct rr_buf *rr_buf_find(struct rr_file *rf, u32 id)
+{
+	struct rr_buf *b;
+
+	list_for_each_entry(b, &rf->bufs, list)
+		if (b->id == id)
+			return b;
+	return NULL;
+}
+
+/* Map a new buffer for the device, if any, and add it to both lists */
+static int rr_buf_add(struct rr_file *rf, struct rr_buf *b)
+{
+	struct rr_dev *dev = rf->dev;
+	int ret = 0;
+
+	b->id = ++rf->lastid;
+
+	mutex_lock(&dev->mutex);
+	if (dev->pdev)
+		ret = rr_buf_map(b, dev->pdev);
+	if (!ret)
+		list_add_tail(&b->devlist, &dev->bufs);
+	mutex_unlock(&dev->mutex);
+	if (ret < 0)
+		return ret;
+	list_add_tail(&b->list, &rf->bufs);
+	rf->nbufs++;
+	return 0;
+}
+
+static int rr_buf_alloc(struct rr_file *rf, struct rr_bufreq *req)
+{
+	struct rr_dev *dev = rf->dev;
+	struct rr_buf *b;
+	int ret;
+
+	if (!req->size || req->size > INT_MAX)
 		return -EINVAL;
+	if (rf->nbufs >= RR_MAX_FILEBUFS)
+		return -ENOSPC;
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+	b->size = PAGE_ALIGN(req->size);
+	b->addr = rr_buf_vzalloc(b->size, dev->node, &b->vpages);
+	if (!b->addr) {
+		kfree(b);
+		return -ENOMEM;
+	}
+	ret = rr_buf_add(rf, b);
+	if (ret < 0) {
+		rr_buf_vfree(b->addr, b->vpages, b->size);
+		kfree(b);
+		return ret;
 	}
+	req->id = b->id;
+	req->size = b->size;
+	req->offset = RR_BUF_OFFSET(b->id);
 	return 0;
 }
 
-static int rr_do_write_mem(struct rr_dev *dev, struct rr_iocmd *iocmd)
+static int rr_buf_free(struct rr_file *rf, struct rr_buf *b)
 {
-	int bar = __RR_GET_BAR(iocmd->address) / 2;
-	int off = __RR_GET_OFF(iocmd->address);
-	struct resource *r = dev->area[bar];
+	struct rr_dev *dev = rf->dev;
 
-	if (off >= r->end - r->start + 1)
-		return -ENOMEDIUM;
+	if (atomic_read(&b->maps))
+		return -EBUSY;
+	mutex_lock(&dev->mutex);
+	if (dev->dma.active && dev->dma.sgt == &b->sgt)
+		rr_dma_abort(dev);
+	list_del(&b->devlist);
+	rr_buf_unmap(b, dev->pdev); /* if mapped, pdev is there */
+	mutex_unlock(&dev->mutex);
 
-	switch(iocmd->datasize) {
-	case 1:
-		writeb(iocmd->data8, dev->remap[bar] + off);
-		break;
-	case 2:
-		if (off & 1)
-			return -EIO;
-		writew(iocmd->data16, dev->remap[bar] + off);
-		break;
-	case 4:
-		if (off & 3)
-			return -EIO;
-		writel(iocmd->data32, dev->remap[bar] + off);
-		break;
-	case 8:
-		if (off & 7)
-			return -EIO;
-		writeq(iocmd->data64, dev->remap[bar] + off);
-		break;
-	default:
-		return -EINVAL;
+	list_del(&b->list);
+	rf->nbufs--;
+	if (b->pages) {
+		/* the device may have written to them */
+		unpin_user_pages_dirty_lock(b->pages, b->npages, true);
+		vfree(b->pages);
 	}
+	rr_buf_vfree(b->addr, b->vpages, b->size);
+	kfree(b);
 	return 0;
 }
 
-static int rr_do_read_io(struct rr_dev *dev, struct rr_iocmd *iocmd)
+/*
+ * Pin memory of the application for DMA. Pages are pinned for long,
+ * as the device can access them until RR_BUFUNPIN or close.
+ */
+static int rr_buf_pin(struct rr_file *rf, struct rr_bufpin *req)
 {
-	int bar = __RR_GET_BAR(iocmd->address) / 2;
-	int off = __RR_GET_OFF(iocmd->address);
-	struct resource *r = dev->area[bar];
-
-	if (off >= r->end - r->start + 1)
-		return -ENOMEDIUM;
+	struct rr_dev *dev = rf->dev;
+	unsigned long start = req->addr & PAGE_MASK;
+	struct rr_buf *b;
+	int ret;
 
-	switch(iocmd->datasize) {
-	case 1:
-		iocmd->data8 = inb(r->start + off);
-		break;
-	case 2:
-		if (off & 1)
-			return -EIO;
-		iocmd->data16 = inw(r->start + off);
-		break;
-	case 4:
-		if (off & 3)
-			return -EIO;
-		iocmd->data32 = inl(r->start + off);
-		break;
-	case 8:
-		if (off & 7)
-			return -EIO;
-		/* assume little-endian bus */
-		iocmd->data64 = inl(r->start + off);
-		iocmd->data64 |= (__u64)(inl(r->start + off + 4)) << 32;
-		break;
-	default:
+	if (!req->size || req->size > INT_MAX
+	    || req->addr + req->size < req->addr)
+		return -EINVAL;
+	/* segment addresses and lengths go to the engine, which needs 4 */
+	if ((req->addr | req->size) & 3)
 		return -EINVAL;
+	if (rf->nbufs >= RR_MAX_FILEBUFS)
+		return -ENOSPC;
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+	b->offset = req->addr & ~PAGE_MASK;
+	b->size = req->size;
+	b->npages = DIV_ROUND_UP(b->offset + b->size, PAGE_SIZE);
+	b->pages = vmalloc(b->npages * sizeof(*b->pages));
+	if (!b->pages) {
+		kfree(b);
+		return -ENOMEM;
 	}
-	return 0;
+	ret = pin_user_pages_fast(start, b->npages,
+				  FOLL_WRITE | FOLL_LONGTERM, b->pages);
+	if (ret < b->npages) {
+		if (ret > 0)
+			unpin_user_pages_dirty_lock(b->pages, ret, false);
+		if (ret >= 0)
+			ret = -EFAULT;
+		goto err;
+	}
+	ret = rr_buf_add(rf, b);
+	if (ret < 0) {
+		unpin_user_pages_dirty_lock(b->pages, b->npages, false);
+		goto err;
+	}
+
+	/* Like RR_GETDMALIST, if there is a device */
+	req->list.id = b->id;
+	mutex_lock(&dev->mutex);
+	if (b->nents)
+		ret = rr_do_getdmalist(&b->sgt, b->nents, &req->list);
+	else
+		req->list.total = req->list.nseg = 0;
+	mutex_unlock(&dev->mutex);
+	if (ret < 0)
+		rr_buf_free(rf, b);
+	return ret;
+
+ err:
+	vfree(b->pages);
+	kfree(b);
+	return ret;
 }
 
-static int rr_do_write_io(struct rr_dev *dev, struct rr_iocmd *iocmd)
+static int rr_do_buf(struct rr_file *rf, unsigned int cmd, unsigned long arg,
+		     void *karg)
 {
-	int bar = __RR_GET_BAR(iocmd->address) / 2 ;
-	int off = __RR_GET_OFF(iocmd->address);
-	struct resource *r = dev->area[bar];
+	struct rr_dev *dev = rf->dev;
+	struct rr_bufreq *req = karg;
+	struct rr_dmalist *list = karg;
+	struct rr_bufpin *pin = karg;
+	struct rr_buf *b = NULL;
+	int ret = 0;
 
-	if (off >= r->end - r->start + 1)
-		return -ENOMEDIUM;
+	mutex_lock(&rf->lock);
+	switch(cmd) {
+	case RR_BUFALLOC:
+		ret = rr_buf_alloc(rf, req);
+		break;
 
-	switch(iocmd->datasize) {
-	case 1:
-		outb(iocmd->data8,  r->start + off);
+	case RR_BUFPIN:
+		ret = rr_buf_pin(rf, pin);
 		break;
-	case 2:
-		if (off & 1)
-			return -EIO;
-		outw(iocmd->data16, r->start + off);
+
+	case RR_BUFFREE:
+	case RR_BUFUNPIN: /* each kind is released by its own command */
+		b = rr_buf_find(rf, arg);
+		if (!b)
+			ret = -ENOENT;
+		else if (!b->pages != (cmd == RR_BUFFREE))
+			ret = -EINVAL;
+		else
+			ret = rr_buf_free(rf, b);
 		break;
-	case 4:
-		if (off & 3)
-			return -EIO;
-		outl(iocmd->data32, r->start + off);
+
+	case RR_BUFINFO:
+		b = rr_buf_find(rf, req->id);
+		if (!b) {
+			ret = -ENOENT;
+			break;
+		}
+		req->flags = b->pages ? RR_BUF_PINNED : 0;
+		req->size = b->size;
+		req->offset = RR_BUF_OFFSET(b->id);
 		break;
-	case 8:
-		if (off & 7)
-			return -EIO;
-		/* assume little-endian bus */
-		outl(iocmd->data64, r->start + off);
-		outl(iocmd->data64 >> 32, r->start + off + 4);
+
+	case RR_BUFSYNC:
+		b = rr_buf_find(rf, req->id);
+		if (!b) {
+			ret = -ENOENT;
+			break;
+		}
+		mutex_lock(&dev->mutex);
+		ret = rr_dma_sync(dev->pdev, &b->sgt, b->nents, req->flags);
+		mutex_unlock(&dev->mutex);
+		break;
+
+	case RR_GETDMALIST:
+		b = rr_buf_find(rf, list->id);
+		if (!b) {
+			ret = -ENOENT;
+			break;
+		}
+		mutex_lock(&dev->mutex);
+		ret = rr_do_getdmalist(&b->sgt, b->nents, list);
+		mutex_unlock(&dev->mutex);
 		break;
-	default:
-		return -EINVAL;
 	}
-	return 0;
+	mutex_unlock(&rf->lock);
+	return ret;
 }
 
-/* This helper is called for dmabuf operations */
-static int rr_do_iocmd_dmabuf(struct rr_dev *dev, unsigned int cmd,
-		       struct rr_iocmd *iocmd)
+static int rr_do_dma(struct rr_file *rf, struct rr_dmareq *req)
 {
-	int off = __RR_GET_OFF(iocmd->address);
-	if (off >= rr_bufsize)
-		return -ENOMEDIUM;
+	struct rr_dev *dev = rf->dev;
+	struct rr_dmactx stackctx, *ctx = &stackctx;
+	struct rr_buf *b = NULL;
+	int ret;
 
-	switch(iocmd->datasize) {
-	case 1:
-		if (cmd == RR_WRITE)
-			*(u8 *)(dev->dmabuf + off) = iocmd->data8;
-		else
-			iocmd->data8 = *(u8 *)(dev->dmabuf + off);
-		break;
-	case 2:
-		if (off & 1)
-			return -EIO;
-		if (cmd == RR_WRITE)
-			*(u16 *)(dev->dmabuf + off) = iocmd->data16;
-		else
-			iocmd->data16 = *(u16 *)(dev->dmabuf + off);
-		break;
-	case 4:
-		if (off & 3)
-			return -EIO;
-		if (cmd == RR_WRITE)
-			*(u32 *)(dev->dmabuf + off) = iocmd->data32;
-		else
-			iocmd->data32 = *(u32 *)(dev->dmabuf + off);
-		break;
-	case 8:
-		if (off & 7)
-			return -EIO;
-		if (cmd == RR_WRITE)
-			*(u64 *)(dev->dmabuf + off) = iocmd->data64;
-		else
-			iocmd->data64 = *(u64 *)(dev->dmabuf + off);
-		break;
-	default:
-		return -EINVAL;
+	if (req->flags & RR_DMA_ASYNC)
+		ctx = &rf->dmactx; /* collected by RR_DMAWAIT */
+
+	mutex_lock(&rf->lock);
+	if (req->id) {
+		b = rr_buf_find(rf, req->id);
+		if (!b) {
+			mutex_unlock(&rf->lock);
+			return -ENOENT;
+		}
 	}
-	return 0;
+	/* the previous async transfer may be running on another board */
+	if (ctx == &rf->dmactx && rf->dmadev
+	    && rf->dmadev->dma.ctx == ctx) {
+		mutex_unlock(&rf->lock);
+		return -EBUSY;
+	}
+	mutex_lock(&dev->mutex);
+	if (b)
+		ret = rr_dma_start(dev, ctx, &b->sgt, b->nents, b->size, req);
+	else
+		ret = rr_dma_start(dev, ctx, &dev->sgt, dev->dma_nents,
+				   dev->bufsize, req);
+	mutex_unlock(&dev->mutex);
+	if (!ret && ctx == &rf->dmactx)
+		rf->dmadev = dev;
+	mutex_unlock(&rf->lock);
+
+	if (ret < 0 || ctx == &rf->dmactx)
+		return ret;
+	return rr_dma_wait(dev, ctx, req, 1);
 }
 
-static int rr_do_iocmd(struct rr_dev *dev, unsigned int cmd,
-		       struct rr_iocmd *iocmd)
+/* Wait for the last RR_DMA_ASYNC of this file, on whatever board it ran */
+static int rr_do_dmawait(struct rr_file *rf, struct rr_dmareq *req)
 {
-	int bar;
-	unsigned off;
+	struct rr_dev *dev;
+
+	mutex_lock(&rf->lock);
+	dev = rf->dmadev; /* referenced by the file until close */
+	mutex_unlock(&rf->lock);
+	if (!dev)
+		return -ENODATA; /* never started */
+	return rr_dma_wait(dev, &rf->dmactx, req, 0);
+}
+
+/* A 32-bit register in I/O memory, for use in the interrupt handler */
+static void __iomem *rr_ack_reg(struct rr_dev *dev, u32 address)
+{
+	int bar = __RR_GET_BAR(address) / 2;
+	u32 off = __RR_GET_OFF(address);
 	struct resource *r;
 
-	bar = __RR_GET_BAR(iocmd->address);
-	off = __RR_GET_OFF(iocmd->address);
+	if (!rr_is_valid_bar(address) || rr_is_dmabuf_bar(address))
+		return NULL;
+	r = dev->area[bar];
+	if (!dev->remap[bar] || (off & 3) || off + 4 > r->end + 1 - r->start)
+		return NULL;
+	return dev->remap[bar] + off;
+}
 
-	if (!rr_is_valid_bar(iocmd->address))
+/* Configure the in-kernel acknowledge, with the device mutex held */
+static int rr_set_irqack(struct rr_dev *dev, struct rr_irqack *req)
+{
+	struct rr_ack *a = &dev->ack;
+	void __iomem *status = NULL, *ack = NULL;
+
+	if (!dev->pdev || !(dev->flags & RR_FLAG_IRQREQUEST))
+		return -ENODEV;
+	if (req->flags & RR_IRQACK_ENABLE) {
+		status = rr_ack_reg(dev, req->status);
+		if (!(req->flags & RR_IRQACK_NOWRITE))
+			ack = rr_ack_reg(dev, req->ack);
+		if (!status || !req->mask
+		    || (!ack && !(req->flags & RR_IRQACK_NOWRITE)))
+			return -EINVAL;
+	}
+
+	/* stop using the old configuration before changing it */
+	a->enabled = 0;
+	synchronize_irq(dev->vec[0].irq);
+	if (!(req->flags & RR_IRQACK_ENABLE))
+		return 0;
+	a->status = status;
+	a->ack = ack;
+	a->mask = req->mask;
+	a->value = req->value;
+	a->flags = req->flags;
+	smp_wmb();
+	a->enabled = 1;
+
+	/* if the interrupt is disabled, we are now able to handle it */
+	if (dev->flags & RR_FLAG_IRQDISABLE) {
+		dev->flags &= ~RR_FLAG_IRQDISABLE;
+		enable_irq(dev->vec[0].irq);
+	}
+	return 0;
+}
+
+/*
+ * Wait for the next interrupt, in the default disable/RR_IRQENA mode too.
+ * Without the mutex, so other commands (RR_IRQENA first) can run meanwhile
+ */
+static int rr_irq_wait(struct rr_dev *dev)
+{
+	unsigned long count = dev->irqcount;
+
+	if (dev->flags & RR_FLAG_IRQDISABLE)
+		return -EAGAIN; /* already happened */
+	if (wait_event_interruptible(dev->q, count != dev->irqcount))
+		return -ERESTARTSYS;
+	rr_latency_record(dev, &dev->lat->wakeup);
+	return 0;
+}
+
+/* Wait for the next interrupt on a vector (the binding can't change) */
+static int rr_vector_wait(struct rr_dev *dev, unsigned long nr)
+{
+	struct rr_vector *v;
+	unsigned long count;
+
+	if (nr >= dev->nvec)
 		return -EINVAL;
+	v = dev->vec + nr;
+	count = v->count;
+	if (wait_event_interruptible(v->q, count != v->count
+				     || !dev->nvec))
+		return -ERESTARTSYS;
+	return dev->nvec ? 0 : -ENODEV;
+}
 
-	if (rr_is_dmabuf_bar(iocmd->address))
-		return rr_do_iocmd_dmabuf(dev, cmd, iocmd);
+/*
+ * Move a file, with its buffers and eventfd, to another device, whose
+ * reference is passed by the caller. Other threads may still be using
+ * the previous device, without a reference of their own, and poll may
+ * have left entries on its queue: so its reference is kept until close,
+ * once for each board the file has been bound to.
+ */
+static int rr_file_bind(struct rr_file *rf, struct rr_dev *new)
+{
+	struct rr_prevdev *p, *prev = NULL;
+	struct rr_dev *old;
+	struct rr_buf *b;
+
+	mutex_lock(&rf->lock);
+	old = rf->dev;
+	if (old == new) {
+		mutex_unlock(&rf->lock);
+		rr_dev_put(new);
+		return 0;
+	}
+	list_for_each_entry(p, &rf->prevdevs, list)
+		if (p->dev == old)
+			prev = p;
+	if (!prev) {
+		p = kmalloc(sizeof(*p), GFP_KERNEL);
+		if (!p) {
+			mutex_unlock(&rf->lock);
+			rr_dev_put(new);
+			return -ENOMEM;
+		}
+		p->dev = old;
+	}
+	mutex_lock(&old->mutex);
+	list_for_each_entry(b, &rf->bufs, list) {
+		if (old->dma.active && old->dma.sgt == &b->sgt)
+			rr_dma_abort(old);
+		list_del(&b->devlist);
+		rr_buf_unmap(b, old->pdev); /* if mapped, pdev is there */
+	}
+	old->usecount--;
+	mutex_unlock(&old->mutex);
+	spin_lock_irq(&old->evlock);
+	if (rf->evfd)
+		list_del(&rf->evlist);
+	spin_unlock_irq(&old->evlock);
+
+	mutex_lock(&new->mutex);
+	list_for_each_entry(b, &rf->bufs, list) {
+		if (new->pdev && rr_buf_map(b, new->pdev) < 0)
+			printk(KERN_WARNING "%s: can't map buffer %i\n",
+			       __func__, b->id);
+		list_add_tail(&b->devlist, &new->bufs);
+	}
+	new->usecount++;
+	mutex_unlock(&new->mutex);
+	spin_lock_irq(&new->evlock);
+	if (rf->evfd)
+		list_add(&rf->evlist, &new->evfiles);
+	rf->evnext = new->evseq;
+	rf->evoverruns = 0;
+	rf->batchseq = new->mod.seq;
+	spin_unlock_irq(&new->evlock);
+
+	/* the list keeps a reference to the old board, only one */
+	if (prev)
+		rr_dev_put(old);
+	else
+		list_add(&p->list, &rf->prevdevs);
+	rf->dev = new;
+	mutex_unlock(&rf->lock);
+	return 0;
+}
 
-	bar /= 2;			/* use 0,1,2 as index */
-	r = dev->area[bar];
+/* With rr_boards_mutex held: a bound board matching the selection */
+static struct rr_dev *rr_devsel_find(struct rr_devsel *sel)
+{
+	struct rr_dev *dev;
 
-	if (!r)
+	list_for_each_entry(dev, &rr_boards, list)
+		if (rr_devsel_match(sel, dev->pdev))
+			return dev;
+	return NULL;
+}
+
+/*
+ * If no bound board matches, look for an unbound device and probe it:
+ * driver_override makes the PCI core match it to us whatever its ids,
+ * and it is cleared again so the device is not reserved for later.
+ * Without driver_override, the ids are added to the driver instead, and
+ * every unbound device with the same ids is probed, not only this one.
+ */
+static int rr_devsel_attach(struct rr_devsel *sel)
+{
+	struct pci_dev *pdev = NULL;
+	int ret;
+
+	while ((pdev = pci_get_device(sel->vendor, sel->device, pdev)))
+		if (rr_devsel_match(sel, pdev))
+			break;
+	if (!pdev)
 		return -ENODEV;
+	ret = -EBUSY;
+	if (pdev->dev.driver) /* ours would be in the list */
+		goto out;
+#ifdef __RR_HAS_DRIVER_OVERRIDE
+	device_lock(&pdev->dev);
+	if (pdev->driver_override) /* the administrator chose a driver */
+		ret = -EBUSY;
+	else
+		ret = 0;
+	device_unlock(&pdev->dev);
+	if (ret)
+		goto out;
+	ret = __RR_SET_OVERRIDE(pdev, rr_pcidrv.name);
+	if (ret)
+		goto out;
+	ret = device_attach(&pdev->dev);
+	__RR_SET_OVERRIDE(pdev, "");
+	if (ret == 0)
+		ret = -ENODEV; /* the probe failed */
+#else
+	ret = pci_add_dynid(&rr_pcidrv, pdev->vendor, pdev->device,
+			    PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0);
+#endif
+ out:
+	pci_dev_put(pdev);
+	return ret < 0 ? ret : 0;
+}
 
-	if (likely(r->flags & IORESOURCE_MEM)) {
-		if (cmd == RR_READ)
-			return rr_do_read_mem(dev, iocmd);
-		else
-			return rr_do_write_mem(dev, iocmd);
+/*
+ * Select the board of this file: nothing to do if it's already bound to
+ * a matching one. Other files, and /dev/rawrabbit, are not affected.
+ */
+static int rr_do_devsel(struct rr_file *rf, struct rr_devsel *sel)
+{
+	struct rr_dev *dev;
+	int ret;
+
+	mutex_lock(&rr_boards_mutex);
+	dev = rf->dev;
+	if (!list_empty(&dev->list) && rr_devsel_match(sel, dev->pdev)) {
+		mutex_unlock(&rr_boards_mutex);
+		return 0;
 	}
-	if (likely(r->flags & IORESOURCE_IO)) {
-		if (cmd == RR_READ)
-			return rr_do_read_io(dev, iocmd);
-		else
-			return rr_do_write_io(dev, iocmd);
+	dev = rr_devsel_find(sel);
+	if (dev)
+		kref_get(&dev->kref);
+	mutex_unlock(&rr_boards_mutex);
+
+	if (!dev) {
+		/* a rare case: serialize, or the same ids are added twice */
+		mutex_lock(&rr_attach_mutex);
+		mutex_lock(&rr_boards_mutex);
+		dev = rr_devsel_find(sel);
+		mutex_unlock(&rr_boards_mutex);
+		ret = dev ? 0 : rr_devsel_attach(sel);
+		mutex_lock(&rr_boards_mutex);
+		dev = rr_devsel_find(sel);
+		if (dev)
+			kref_get(&dev->kref);
+		mutex_unlock(&rr_boards_mutex);
+		mutex_unlock(&rr_attach_mutex);
+		if (ret < 0)
+			return ret;
+		if (!dev)
+			return -ENODEV;
 	}
-	return -EIO;
+	return rr_file_bind(rf, dev);
 }
 
-
 /*
  * The ioctl method is the one used for strange stuff (see docs)
  */
 static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
-	struct rr_dev *dev = f->private_data;
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
 	int size = _IOC_SIZE(cmd); /* the size bitfield in cmd */
-	int ret = 0;
-	unsigned long count;
-	struct timespec tv, tvirq;
+	int i, ret = 0;
+	s64 delay;
 	void *addr;
 	u32 __user *uptr = (u32 __user *)arg;
 
@@ -469,6 +2240,18 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	union {
 		struct rr_iocmd iocmd;
 		struct rr_devsel devsel;
+		struct rr_iov iov;
+		struct rr_seq seq;
+		struct rr_dmalist dmalist;
+		struct rr_bufreq bufreq;
+		struct rr_bufpin bufpin;
+		struct rr_dmareq dmareq;
+		struct rr_streamreq streamreq;
+		struct rr_evstat evstat;
+		struct rr_irqinfo irqinfo;
+		struct rr_irqack irqack;
+		struct rr_irqmod irqmod;
+		struct rr_irqbatch irqbatch;
 	} karg;
 
 	/*
@@ -485,40 +2268,84 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	 * "write" is reversed
 	 */
 	if (_IOC_DIR(cmd) & _IOC_READ) {
-		if (!access_ok(VERIFY_WRITE, (void *)arg, size))
+		if (!__RR_ACCESS_OK(VERIFY_WRITE, (void __user *)arg, size))
 			return -EFAULT;
 	}
 	else if (_IOC_DIR(cmd) & _IOC_WRITE) {
-		if (!access_ok(VERIFY_READ, (void *)arg, size))
+		if (!__RR_ACCESS_OK(VERIFY_READ, (void __user *)arg, size))
+			return -EFAULT;
+	}
+
+	/* first, retrieve data from userspace */
+	if ((_IOC_DIR(cmd) & _IOC_WRITE) && (size <= sizeof(karg)))
+		if (copy_from_user(&karg, (void *)arg, size))
 			return -EFAULT;
+
+	/* register access is not serialized: SRCU protects the binding */
+	switch(cmd) {
+	case RR_DEVSEL:	/* Select another board for this file */
+		ret = rr_do_devsel(rf, &karg.devsel);
+		goto out;
+
+	case RR_READ:	/* Read a "word" of memory */
+	case RR_WRITE:	/* Write a "word" of memory */
+		ret = rr_do_iocmd(dev, cmd, &karg.iocmd);
+		goto out;
+
+	case RR_IOV:	/* Several reads or writes with a single call */
+		ret = rr_do_iov(dev, &karg.iov);
+		goto out;
+
+	case RR_IRQWAIT:	/* Wait for an interrupt; not holding the mutex */
+		ret = rr_irq_wait(dev);
+		goto out;
+
+	case RR_VECWAIT:	/* Wait for a vector; not holding the mutex */
+		ret = rr_vector_wait(dev, arg);
+		goto out;
+
+	case RR_IRQBATCH:	/* Wait for the next batch of events */
+		ret = rr_irqbatch(rf, &karg.irqbatch);
+		goto out;
+
+	case RR_LATENCY:	/* Histograms, copied by the function itself */
+		return rr_get_latency(dev, (void __user *)arg);
+
+	case RR_EVENTFD:	/* Signal an eventfd; the file lock, no mutex */
+		ret = rr_set_eventfd(rf, (int)arg);
+		goto out;
+
+	/* buffers of this file: their lock is taken before the mutex */
+	case RR_GETDMALIST:
+		if (!karg.dmalist.id)
+			break; /* the device buffer, below */
+		/* fall through */
+	case RR_BUFALLOC:
+	case RR_BUFFREE:
+	case RR_BUFINFO:
+	case RR_BUFSYNC:
+	case RR_BUFPIN:
+	case RR_BUFUNPIN:
+		ret = rr_do_buf(rf, cmd, arg, &karg);
+		goto out;
+
+	case RR_DMA:	/* Run the DMA engine, and wait unless async */
+	case RR_DMAWAIT: /* Wait for an async transfer */
+		if (cmd == RR_DMA)
+			ret = rr_do_dma(rf, &karg.dmareq);
+		else
+			ret = rr_do_dmawait(rf, &karg.dmareq);
+		/* on error the generic copy is skipped, but report status */
+		if (ret == -EIO && copy_to_user((void *)arg, &karg, size))
+			ret = -EFAULT;
+		goto out;
 	}
 
-	/* first, retrieve data from userspace */
-	if ((_IOC_DIR(cmd) & _IOC_WRITE) && (size <= sizeof(karg)))
-		if (copy_from_user(&karg, (void *)arg, size))
-			return -EFAULT;
-
 	/* serialize the switch with other processes */
 	mutex_lock(&dev->mutex);
 
 	switch(cmd) {
 
-	case RR_DEVSEL:
-		/* If we are the only user, change device requested id */
-		if (dev->usecount > 1) {
-			printk("usecount %i\n", dev->usecount);
-			ret = -EBUSY;
-			break;
-		}
-		/* Warning: race: we can't take the lock */
-		*dev->devsel = karg.devsel;
-		ret = rr_fill_table_and_probe(dev);
-		if (!ret)
-			ret = -ENODEV; /* timeout */
-		else if (ret > 0)
-			ret = 0; /* success */
-		break;
-
 	case RR_DEVGET:
 		/* Return to user space the id of the current device */
 		if (!dev->pdev) {
@@ -534,47 +2361,51 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 		karg.devsel.devfn = dev->pdev->devfn;
 		break;
 
-	case RR_READ:	/* Read a "word" of memory */
-	case RR_WRITE:	/* Write a "word" of memory */
-		ret = rr_do_iocmd(dev, cmd, &karg.iocmd);
-		break;
-
-	case RR_IRQWAIT: /* Wait for an interrupt to happen */
-		count = dev->irqcount;
-		if (dev->flags & RR_FLAG_IRQDISABLE) {
-			ret = -EAGAIN; /* already happened */
-			break;
-		}
-		wait_event_interruptible(dev->q, count != dev->irqcount);
-		if (signal_pending(current))
-			ret = -ERESTARTSYS;
+	case RR_SEQ:	/* Run a sequence of operations, serialized */
+		ret = rr_do_seq(dev, &karg.seq);
+		/* on error the generic copy is skipped, but report progress */
+		if (ret < 0 && copy_to_user((void *)arg, &karg, size))
+			ret = -EFAULT;
 		break;
 
 	case RR_IRQENA:	/* Re-enable the interrupt after handling it */
-		getnstimeofday(&tv);
-		tvirq = dev->irqtime;
+		delay = ktime_to_ns(ktime_sub(ktime_get(), dev->irqstamp));
 		if ( !(dev->flags & RR_FLAG_IRQDISABLE)) {
 			ret = -EAGAIN;
 			break;
 		}
 		dev->flags &= ~RR_FLAG_IRQDISABLE;
-		enable_irq(dev->pdev->irq);
+		enable_irq(dev->vec[0].irq);
+		rr_latency_record(dev, &dev->lat->ack);
 
 		/* return the delay to user space, capped at 1s */
-		if (tv.tv_sec - tvirq.tv_sec > 1) {
-			ret = NSEC_PER_SEC;
-			break;
-		}
-		ret = (tv.tv_sec - tvirq.tv_sec) * NSEC_PER_SEC
-			+ tv.tv_nsec - tvirq.tv_nsec;
-		if (ret > NSEC_PER_SEC) {
-			ret = NSEC_PER_SEC;
+		ret = min_t(s64, delay, NSEC_PER_SEC);
+		break;
+
+	case RR_SETWIDTH:	/* Access size for bulk read and write */
+		if (arg != 0 && arg != 1 && arg != 2 && arg != 4 && arg != 8) {
+			ret = -EINVAL;
 			break;
 		}
+		if (arg)
+			rf->width = arg;
+		ret = rf->width;
 		break;
 
 	case RR_GETDMASIZE:	/* Return the current dma size */
-		ret = rr_bufsize;
+		ret = dev->bufsize;
+		break;
+
+	case RR_SETDMASIZE:	/* Reallocate the buffer, if nobody uses it */
+		ret = rr_do_setdmasize(dev, arg);
+		break;
+
+	case RR_EXPORT:		/* Return a dma-buf file for the buffer */
+#ifdef __RR_HAS_DMABUF
+		ret = rr_dmabuf_export(dev, arg);
+#else
+		ret = -ENOIOCTLCMD;
+#endif
 		break;
 
 	case RR_GETPLIST:	/* Return the page list */
@@ -585,11 +2416,16 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 			__page_size_is_not_4096(); /* undefined symbol */
 		}
 
-		if (!access_ok(VERIFY_WRITE, arg, RR_PLIST_SIZE)) {
+		/* A single page can't describe bigger buffers */
+		if (dev->bufsize > RR_MAX_BUFSIZE) {
+			ret = -E2BIG;
+			break;
+		}
+		if (!__RR_ACCESS_OK(VERIFY_WRITE, uptr, RR_PLIST_SIZE)) {
 			ret = -EFAULT;
 			break;
 		}
-		for (addr = dev->dmabuf; addr - dev->dmabuf < rr_bufsize;
+		for (addr = dev->dmabuf; addr - dev->dmabuf < dev->bufsize;
 		     addr += PAGE_SIZE) {
 			if (0) {
 				printk("page @ %p - pfn %08lx\n", addr,
@@ -600,12 +2436,66 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 		}
 		break;
 
+	case RR_GETDMALIST:	/* Return the bus addresses of the buffer */
+		ret = rr_do_getdmalist(&dev->sgt, dev->dma_nents,
+				       &karg.dmalist);
+		break;
+
+	case RR_DMASYNC:	/* Pass buffer ownership to cpu or device */
+		ret = rr_dma_sync(dev->pdev, &dev->sgt, dev->dma_nents, arg);
+		break;
+
+	case RR_STREAMON:	/* Fill slots of the buffer, forever */
+		ret = rr_stream_start(dev, &karg.streamreq);
+		break;
+
+	case RR_STREAMOFF:
+		if (!dev->stream.active) {
+			ret = -EINVAL;
+			break;
+		}
+		rr_dma_abort(dev);
+		break;
+
+	case RR_STREAMSTAT:
+		rr_stream_stat(dev, &karg.streamreq);
+		break;
+
+	case RR_IRQACK:		/* Acknowledge in the handler, not disabling */
+		ret = rr_set_irqack(dev, &karg.irqack);
+		break;
+
+	case RR_IRQMOD:		/* Coalesce wakeups by count or time */
+		ret = rr_set_irqmod(dev, &karg.irqmod);
+		break;
+
+	case RR_IRQINFO:	/* Vectors in use, and their counters */
+		memset(&karg.irqinfo, 0, sizeof(karg.irqinfo));
+		karg.irqinfo.nvec = dev->nvec;
+		if (dev->pdev && dev->pdev->msix_enabled)
+			karg.irqinfo.type = RR_IRQ_MSIX;
+		else if (dev->pdev && dev->pdev->msi_enabled)
+			karg.irqinfo.type = RR_IRQ_MSI;
+		for (i = 0; i < dev->nvec; i++)
+			karg.irqinfo.count[i] = dev->vec[i].count;
+		break;
+
+	case RR_EVSTAT:		/* Sequence numbers and losses of this file */
+		spin_lock_irq(&dev->evlock);
+		rr_event_catchup(dev, rf);
+		karg.evstat.seq = dev->evseq;
+		karg.evstat.next = rf->evnext;
+		karg.evstat.overruns = rf->evoverruns;
+		spin_unlock_irq(&dev->evlock);
+		break;
+
 	default:
 		ret = -ENOIOCTLCMD;
 		break;
 	}
 	/* finally, copy data to user space and return */
 	mutex_unlock(&dev->mutex);
+ out:
 	if (ret < 0)
 		return ret;
 	if ((_IOC_DIR(cmd) & _IOC_READ) && (size <= sizeof(karg)))
@@ -614,13 +2504,187 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+#ifdef __RR_HAS_DMABUF
+static int rr_mmap_dmabuf(struct vm_area_struct *vma, void *buf,
+			  unsigned long bufsize, atomic_t *maps,
+			  unsigned long off, unsigned long size);
+
+/*
+ * The device buffer is exported as a dma-buf, for other processes and
+ * drivers. Each dma-buf holds a reference to the device, so the memory
+ * outlives the board, and RR_SETDMASIZE fails while any of them exists.
+ * Importers map the pages for their own device, not the board.
+ */
+static struct sg_table *rr_dmabuf_map(struct dma_buf_attachment *at,
+				      enum dma_data_direction dir)
+{
+	struct rr_dev *dev = at->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+	ret = __rr_dma_table(dev->dmabuf, dev->bufsize,
+			     dma_get_max_seg_size(at->dev), sgt);
+	if (ret)
+		goto out_free;
+	ret = dma_map_sg(at->dev, sgt->sgl, sgt->orig_nents, dir);
+	if (!ret) {
+		sg_free_table(sgt);
+		ret = -EIO;
+		goto out_free;
+	}
+	sgt->nents = ret;
+	return sgt;
+
+ out_free:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void rr_dmabuf_unmap(struct dma_buf_attachment *at,
+			    struct sg_table *sgt, enum dma_data_direction dir)
+{
+	dma_unmap_sg(at->dev, sgt->sgl, sgt->orig_nents, dir);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int rr_dmabuf_mmap(struct dma_buf *db, struct vm_area_struct *vma)
+{
+	struct rr_dev *dev = db->priv;
+
+	return rr_mmap_dmabuf(vma, dev->dmabuf, dev->bufsize,
+			      &dev->dmabuf_maps, vma->vm_pgoff << PAGE_SHIFT,
+			      vma->vm_end - vma->vm_start);
+}
+
+static void rr_dmabuf_release(struct dma_buf *db)
+{
+	struct rr_dev *dev = db->priv;
+
+	atomic_dec(&dev->dmabuf_exports);
+	rr_dev_put(dev);
+}
+
+static const struct dma_buf_ops rr_dmabuf_ops = {
+	.map_dma_buf	= rr_dmabuf_map,
+	.unmap_dma_buf	= rr_dmabuf_unmap,
+	.mmap		= rr_dmabuf_mmap,
+	.release	= rr_dmabuf_release,
+};
+
+/* Called with the mutex held, so the buffer can't change meanwhile */
+static int rr_dmabuf_export(struct rr_dev *dev, unsigned long flags)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(info);
+	struct dma_buf *db;
+	int fd;
+
+	if (flags & ~O_CLOEXEC)
+		return -EINVAL;
+	info.ops = &rr_dmabuf_ops;
+	info.size = dev->bufsize;
+	info.flags = O_RDWR;
+	info.priv = dev;
+	db = dma_buf_export(&info);
+	if (IS_ERR(db))
+		return PTR_ERR(db);
+	kref_get(&dev->kref);
+	atomic_inc(&dev->dmabuf_exports);
+	fd = dma_buf_fd(db, flags);
+	if (fd < 0)
+		dma_buf_put(db); /* and the release above undoes the rest */
+	return fd;
+}
+#endif /* __RR_HAS_DMABUF */
+
+#ifdef __RR_HAS_URING_CMD
+/*
+ * io_uring passthrough, using the ioctl implementation. Register access
+ * completes inline, while commands that may sleep return EAGAIN when
+ * called non-blocking: io_uring then runs them from its worker threads.
+ */
+static int rr_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	const struct rr_uring_cmd *c = __RR_URING_CMD_PDU(ioucmd);
+	unsigned int cmd = ioucmd->cmd_op;
+	long ret;
+
+	switch(cmd) {
+	case RR_READ:
+	case RR_WRITE:
+	case RR_IOV:
+		break;
+	case RR_SEQ:
+	case RR_IRQWAIT:
+	case RR_VECWAIT:
+	case RR_IRQBATCH:
+	case RR_DMA:
+	case RR_DMAWAIT:
+	case RR_BUFSYNC:
+		if (issue_flags & IO_URING_F_NONBLOCK)
+			return -EAGAIN;
+		break;
+	default:
+		return -ENOTTY;
+	}
+	ret = rr_ioctl(ioucmd->file, cmd, READ_ONCE(c->arg));
+	if (ret == -ERESTARTSYS)
+		ret = -EINTR; /* no restart from a completion */
+	if (ret == -EAGAIN)
+		ret = -EALREADY; /* RR_IRQWAIT: io_uring would retry EAGAIN */
+	return ret;
+}
+#endif
+
 /*
  * Other fops are more conventional
  */
 static int rr_open(struct inode *ino, struct file *f)
 {
-	struct rr_dev *dev = &rr_dev;
-	f->private_data = dev;
+	struct rr_dev *dev;
+	struct rr_file *rf;
+
+	/*
+	 * misc_open set private_data to our miscdevice, and holds its mutex:
+	 * misc_deregister in rr_pciremove waits for us to take a reference
+	 */
+	if (f->private_data == &rr_misc) {
+		mutex_lock(&rr_boards_mutex);
+		dev = rr_selected ? rr_selected : rr_nodev;
+		kref_get(&dev->kref);
+		mutex_unlock(&rr_boards_mutex);
+	} else {
+		dev = container_of(f->private_data, struct rr_dev, misc);
+		kref_get(&dev->kref);
+	}
+
+	rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+	if (!rf) {
+		rr_dev_put(dev);
+		return -ENOMEM;
+	}
+	rf->dev = dev;
+	rf->width = RR_DEFAULT_WIDTH;
+	mutex_init(&rf->lock);
+	INIT_LIST_HEAD(&rf->bufs);
+	INIT_LIST_HEAD(&rf->prevdevs);
+	f->private_data = rf;
+
+	/* the first file pins its inode, until the last one is closed */
+	mutex_lock(&rr_inode_mutex);
+	if (!rr_nfiles++)
+		rr_inode = igrab(ino);
+	f->f_mapping = rr_inode->i_mapping;
+	mutex_unlock(&rr_inode_mutex);
+
+	/* this file will see the events from now on */
+	spin_lock_irq(&dev->evlock);
+	rf->evnext = dev->evseq;
+	rf->batchseq = dev->mod.seq;
+	spin_unlock_irq(&dev->evlock);
 
 	mutex_lock(&dev->mutex);
 	dev->usecount++;
@@ -631,27 +2695,371 @@ static int rr_open(struct inode *ino, struct file *f)
 
 static int rr_release(struct inode *ino, struct file *f)
 {
-	struct rr_dev *dev = f->private_data;
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
+	struct rr_prevdev *p, *ptmp;
+	struct rr_buf *b, *tmp;
+
+	rr_set_eventfd(rf, -1);
+
+	/* no mapping is left, as each of them holds the file open */
+	mutex_lock(&rf->lock);
+	list_for_each_entry_safe(b, tmp, &rf->bufs, list)
+		rr_buf_free(rf, b);
+	mutex_unlock(&rf->lock);
+
+	/* nobody can collect our async transfer, and rf is going away */
+	if (rf->dmadev) {
+		mutex_lock(&rf->dmadev->mutex);
+		if (rf->dmadev->dma.ctx == &rf->dmactx)
+			rr_dma_abort(rf->dmadev);
+		mutex_unlock(&rf->dmadev->mutex);
+	}
 
 	mutex_lock(&dev->mutex);
 	dev->usecount--;
 	mutex_unlock(&dev->mutex);
 
+	mutex_lock(&rr_inode_mutex);
+	if (!--rr_nfiles) {
+		iput(rr_inode);
+		rr_inode = NULL;
+	}
+	mutex_unlock(&rr_inode_mutex);
+
+	list_for_each_entry_safe(p, ptmp, &rf->prevdevs, list) {
+		rr_dev_put(p->dev);
+		kfree(p);
+	}
+	kfree(rf);
+	rr_dev_put(dev);
+	return 0;
+}
+
+/* vm_private_data points to the counter of mappings of the buffer */
+static void rr_dmabuf_vm_open(struct vm_area_struct *vma)
+{
+	atomic_inc((atomic_t *)vma->vm_private_data);
+}
+
+static void rr_dmabuf_vm_close(struct vm_area_struct *vma)
+{
+	atomic_dec((atomic_t *)vma->vm_private_data);
+}
+
+static struct vm_operations_struct rr_dmabuf_vm_ops = {
+	.open = rr_dmabuf_vm_open,
+	.close = rr_dmabuf_vm_close,
+};
+
+/*
+ * BAR mappings are zapped when the board is removed (for all boards, as
+ * the address space is shared): refault the page while the board is
+ * there. vm_private_data is the board, kept by the file of the mapping.
+ */
+static vm_fault_t rr_bar_vm_fault(__RR_FAULT_ARGS)
+{
+	struct vm_area_struct *vma = __RR_FAULT_VMA(vmf);
+	struct rr_dev *dev = vma->vm_private_data;
+	u64 pos = (u64)vmf->pgoff << PAGE_SHIFT;
+	int bar = __RR_GET_BAR(pos) / 2;
+	vm_fault_t ret = VM_FAULT_SIGBUS;
+	int idx;
+
+	idx = srcu_read_lock(&dev->srcu);
+	if (srcu_dereference(dev->pdev, &dev->srcu) && dev->area[bar])
+		ret = vmf_insert_pfn(vma, __RR_FAULT_ADDR(vmf),
+				     (dev->area[bar]->start
+				      + __RR_GET_OFF(pos)) >> PAGE_SHIFT);
+	srcu_read_unlock(&dev->srcu, idx);
+	return ret;
+}
+
+static struct vm_operations_struct rr_bar_vm_ops = {
+	.fault = rr_bar_vm_fault,
+};
+
+/*
+ * DMA buffers are vmalloc memory: insert their pages one by one, so
+ * user space shares the same pages that RR_GETPLIST returns.
+ */
+static int rr_mmap_dmabuf(struct vm_area_struct *vma, void *buf,
+			  unsigned long bufsize, atomic_t *maps,
+			  unsigned long off, unsigned long size)
+{
+	unsigned long uaddr = vma->vm_start;
+	int ret;
+
+	if (off >= bufsize || size > bufsize - off)
+		return -ENXIO;
+	vm_flags_set(vma, VM_RESERVED);
+	for (; uaddr < vma->vm_end; uaddr += PAGE_SIZE, off += PAGE_SIZE) {
+		ret = vm_insert_page(vma, uaddr, vmalloc_to_page(buf + off));
+		if (ret)
+			return ret;
+	}
+	/* count the mappings, as the buffer can't be freed under them */
+	vma->vm_ops = &rr_dmabuf_vm_ops;
+	vma->vm_private_data = maps;
+	rr_dmabuf_vm_open(vma);
 	return 0;
 }
 
+static int rr_mmap_filebuf(struct rr_file *rf, struct vm_area_struct *vma,
+			   u64 pos, unsigned long size)
+{
+	struct rr_buf *b;
+	int ret = -ENXIO;
+
+	mutex_lock(&rf->lock);
+	b = rr_buf_find(rf, RR_BUF_ID(pos));
+	if (b && b->addr)
+		ret = rr_mmap_dmabuf(vma, b->addr, b->size, &b->maps,
+				     (u32)pos, size);
+	mutex_unlock(&rf->lock);
+	return ret;
+}
+
+/*
+ * mmap uses the same offsets as read and write: BAR areas are mapped
+ * uncached, so user space can access registers with no system call,
+ * and the DMA buffer is shared with no copy.
+ */
 static int rr_mmap(struct file *f, struct vm_area_struct *vma)
 {
-	return -EOPNOTSUPP;
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
+	u64 pos = (u64)vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long off, barsize;
+	struct resource *r;
+	int bar, ret;
+
+	if (RR_BUF_ID(pos))
+		return rr_mmap_filebuf(rf, vma, pos, size);
+	if (!rr_is_valid_bar(pos))
+		return -EINVAL;
+	bar = __RR_GET_BAR(pos) / 2; /* index in the array */
+	off = __RR_GET_OFF(pos);
+
+	mutex_lock(&dev->mutex);
+	if (RR_IS_DMABUF(pos)) {
+		ret = rr_mmap_dmabuf(vma, dev->dmabuf, dev->bufsize,
+				     &dev->dmabuf_maps, off, size);
+		goto out;
+	}
+	r = dev->area[bar];
+	ret = -EINVAL;
+	if (!r || !dev->remap[bar])
+		goto out; /* inexistent or I/O ports, like read/write */
+	ret = -ENXIO;
+	if (r->start & ~PAGE_MASK)
+		goto out; /* can't map a partial page */
+	ret = -EINVAL;
+	if (!(vma->vm_flags & VM_SHARED))
+		goto out; /* private would be copy-on-write, and not faultable */
+	ret = -ENXIO;
+	barsize = PAGE_ALIGN(r->end + 1 - r->start);
+	if (off >= barsize || size > barsize - off)
+		goto out;
+
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	vm_flags_set(vma, VM_IO | VM_RESERVED);
+	ret = io_remap_pfn_range(vma, vma->vm_start,
+				 (r->start + off) >> PAGE_SHIFT,
+				 size, vma->vm_page_prot);
+	vma->vm_ops = &rr_bar_vm_ops;
+	vma->vm_private_data = dev;
+ out:
+	mutex_unlock(&dev->mutex);
+	return ret;
 }
 
-static ssize_t rr_read(struct file *f, char __user *buf, size_t count,
-		       loff_t *offp)
+/*
+ * Bulk transfers to I/O memory use sized accesses (the width of the
+ * file, set by RR_SETWIDTH) through a bounce buffer, one page at a time.
+ */
+static void rr_ioread(void *dst, void __iomem *src, size_t count, int width)
+{
+	void *end = dst + count;
+
+	switch(width) {
+	case 1:
+		for (; dst < end; dst += 1, src += 1)
+			*(u8 *)dst = readb(src);
+		break;
+	case 2:
+		for (; dst < end; dst += 2, src += 2)
+			*(u16 *)dst = readw(src);
+		break;
+	case 4:
+		for (; dst < end; dst += 4, src += 4)
+			*(u32 *)dst = readl(src);
+		break;
+	case 8:
+		for (; dst < end; dst += 8, src += 8)
+			*(u64 *)dst = readq(src);
+		break;
+	}
+}
+
+static void rr_iowrite(void __iomem *dst, void *src, size_t count, int width)
+{
+	void *end = src + count;
+
+	switch(width) {
+	case 1:
+		for (; src < end; dst += 1, src += 1)
+			writeb(*(u8 *)src, dst);
+		break;
+	case 2:
+		for (; src < end; dst += 2, src += 2)
+			writew(*(u16 *)src, dst);
+		break;
+	case 4:
+		for (; src < end; dst += 4, src += 4)
+			writel(*(u32 *)src, dst);
+		break;
+	case 8:
+		for (; src < end; dst += 8, src += 8)
+			writeq(*(u64 *)src, dst);
+		break;
+	}
+}
+
+static ssize_t rr_read_bulk(char __user *buf, void __iomem *addr,
+			    size_t count, int width)
+{
+	void *bounce;
+	size_t done, n;
+	ssize_t ret = 0;
+
+	if (((unsigned long)addr | count) & (width - 1))
+		return -EIO;
+	bounce = (void *)__get_free_page(GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+	for (done = 0; done < count; done += n) {
+		n = min_t(size_t, count - done, PAGE_SIZE);
+		rr_ioread(bounce, addr + done, n, width);
+		if (copy_to_user(buf + done, bounce, n)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	free_page((unsigned long)bounce);
+	return done ? done : ret;
+}
+
+static ssize_t rr_write_bulk(void __iomem *addr, const char __user *buf,
+			     size_t count, int width)
+{
+	void *bounce;
+	size_t done, n;
+	ssize_t ret = 0;
+
+	if (((unsigned long)addr | count) & (width - 1))
+		return -EIO;
+	bounce = (void *)__get_free_page(GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+	for (done = 0; done < count; done += n) {
+		n = min_t(size_t, count - done, PAGE_SIZE);
+		if (copy_from_user(bounce, buf + done, n)) {
+			ret = -EFAULT;
+			break;
+		}
+		rr_iowrite(addr + done, bounce, n, width);
+	}
+	free_page((unsigned long)bounce);
+	return done ? done : ret;
+}
+
+/*
+ * Reading the stream returns whole slots, and blocks until one is ready.
+ * The file position is not changed, and EOF is returned when stopped.
+ */
+static ssize_t rr_stream_read(struct rr_dev *dev, char __user *buf,
+			      size_t count, int nonblock)
+{
+	struct rr_stream *s = &dev->stream;
+	unsigned long c, n, i, bufsize;
+	u32 slotsize, nslots;
+	int active, idx;
+	void *base;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&s->mutex))
+		return -ERESTARTSYS;
+ again:
+	spin_lock_irq(&dev->dma.lock);
+	c = s->consumer;
+	n = s->producer - c;
+	active = s->active;
+	slotsize = s->slotsize;
+	nslots = s->nslots;
+	spin_unlock_irq(&dev->dma.lock);
+
+	if (!n) {
+		ret = 0; /* EOF */
+		if (!active)
+			goto out;
+		ret = -EAGAIN;
+		if (nonblock)
+			goto out;
+		ret = -ERESTARTSYS;
+		if (wait_event_interruptible(s->q, s->producer != s->consumer
+					     || !s->active))
+			goto out;
+		goto again;
+	}
+	ret = -EINVAL;
+	if (count < slotsize)
+		goto out;
+	if (n > count / slotsize)
+		n = count / slotsize;
+	/* RR_SETDMASIZE frees the old buffer after an srcu grace period */
+	idx = srcu_read_lock(&dev->srcu);
+	base = rr_get_dmabuf(dev, &bufsize);
+	ret = 0;
+	if ((u64)slotsize * nslots > bufsize)
+		n = 0; /* being reallocated */
+	for (i = 0; i < n; i++) {
+		if (copy_to_user(buf + i * slotsize,
+				 base + ((c + i) & (nslots - 1)) * slotsize,
+				 slotsize)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	srcu_read_unlock(&dev->srcu, idx);
+	if (ret || !n)
+		goto out;
+
+	/* if the engine reached our slots in the meantime, data is bad */
+	spin_lock_irq(&dev->dma.lock);
+	if (s->producer - c >= nslots) {
+		spin_unlock_irq(&dev->dma.lock);
+		goto again; /* they were dropped, and counted as overruns */
+	}
+	s->consumer = c + n;
+	spin_unlock_irq(&dev->dma.lock);
+	ret = n * slotsize;
+ out:
+	mutex_unlock(&s->mutex);
+	return ret;
+}
+
+static ssize_t __rr_read(struct file *f, char __user *buf, size_t count,
+			 loff_t *offp)
 {
-	struct rr_dev *dev = f->private_data;
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
 	void *base;
 	loff_t pos = *offp;
 	int bar, off, size;
+	unsigned long bufsize;
+	ssize_t ret;
 
 	bar = __RR_GET_BAR(pos) / 2; /* index in the array */
 	off = __RR_GET_OFF(pos);
@@ -663,19 +3071,19 @@ static ssize_t rr_read(struct file *f, char __user *buf, size_t count,
 
 	/* reading the DMA buffer is trivial, so do it first */
 	if (RR_IS_DMABUF(pos)) {
-		base = dev->dmabuf;
-		if (off >= rr_bufsize)
+		base = rr_get_dmabuf(dev, &bufsize);
+		if (off >= bufsize)
 			return 0; /* EOF */
-		if (off + count > rr_bufsize)
-			count = rr_bufsize - off;
+		if (off + count > bufsize)
+			count = bufsize - off;
 		if (copy_to_user(buf, base + off, count))
 			return -EFAULT;
 		*offp += count;
 		return count;
 	}
 
-	/* inexistent or I/O ports: EINVAL */
-	if (!dev->remap[bar])
+	/* unbound, inexistent or I/O ports: EINVAL */
+	if (!srcu_dereference(dev->pdev, &dev->srcu) || !dev->remap[bar])
 		return -EINVAL;
 	base = dev->remap[bar];
 
@@ -703,20 +3111,25 @@ static ssize_t rr_read(struct file *f, char __user *buf, size_t count,
 			return -EFAULT;
 		break;
 	default:
-		if (copy_to_user(buf, base + off, count))
-			return -EFAULT;
+		ret = rr_read_bulk(buf, base + off, count, rf->width);
+		if (ret < 0)
+			return ret;
+		count = ret;
 	}
 	*offp += count;
 	return count;
 }
 
-static ssize_t rr_write(struct file *f, const char __user *buf, size_t count,
-		 loff_t *offp)
+static ssize_t __rr_write(struct file *f, const char __user *buf,
+			  size_t count, loff_t *offp)
 {
-	struct rr_dev *dev = f->private_data;
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
 	void *base;
 	loff_t pos = *offp;
 	int bar, off, size;
+	unsigned long bufsize;
+	ssize_t ret;
 	union {u8 d8; u16 d16; u32 d32; u64 d64;} data;
 	bar = __RR_GET_BAR(pos) / 2; /* index in the array */
 	off = __RR_GET_OFF(pos);
@@ -725,19 +3138,19 @@ static ssize_t rr_write(struct file *f, const char __user *buf, size_t count,
 
 	/* writing the DMA buffer is trivial, so do it first */
 	if (RR_IS_DMABUF(pos)) {
-		base = dev->dmabuf;
-		if (off >= rr_bufsize)
+		base = rr_get_dmabuf(dev, &bufsize);
+		if (off >= bufsize)
 			return -ENOSPC;
-		if (off + count > rr_bufsize)
-			count = rr_bufsize - off;
+		if (off + count > bufsize)
+			count = bufsize - off;
 		if (copy_from_user(base + off, buf, count))
 			return -EFAULT;
 		*offp += count;
 		return count;
 	}
 
-	/* inexistent or I/O ports: EINVAL */
-	if (!dev->remap[bar])
+	/* unbound, inexistent or I/O ports: EINVAL */
+	if (!srcu_dereference(dev->pdev, &dev->srcu) || !dev->remap[bar])
 		return -EINVAL;
 	base = dev->remap[bar];
 
@@ -770,23 +3183,165 @@ static ssize_t rr_write(struct file *f, const char __user *buf, size_t count,
 		writeq(data.d64, base + off);
 		break;
 	default:
-		if (copy_from_user(base + off, buf, count))
-			return -EFAULT;
+		ret = rr_write_bulk(base + off, buf, count, rf->width);
+		if (ret < 0)
+			return ret;
+		count = ret;
 	}
 	*offp += count;
 	return count;
 }
 
+/* Buffers of the file are plain memory, like the device buffer */
+static ssize_t rr_rw_filebuf(struct rr_file *rf, char __user *buf,
+			     size_t count, loff_t *offp, int write)
+{
+	unsigned long off = (u32)*offp;
+	struct rr_buf *b;
+	ssize_t ret;
+
+	mutex_lock(&rf->lock);
+	b = rr_buf_find(rf, RR_BUF_ID(*offp));
+	if (!b || !b->addr) { /* pinned buffers belong to the application */
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = write ? -ENOSPC : 0; /* EOF */
+	if (off >= b->size)
+		goto out;
+	if (count > b->size - off)
+		count = b->size - off;
+	if (write)
+		ret = copy_from_user(b->addr + off, buf, count);
+	else
+		ret = copy_to_user(buf, b->addr + off, count);
+	if (ret) {
+		ret = -EFAULT;
+		goto out;
+	}
+	*offp += count;
+	ret = count;
+ out:
+	mutex_unlock(&rf->lock);
+	return ret;
+}
+
+/* Events are copied with the lock held, so they are consistent */
+static ssize_t rr_event_read(struct rr_file *rf, char __user *buf,
+			     size_t count, int nonblock)
+{
+	struct rr_dev *dev = rf->dev;
+	struct rr_event *ev;
+	unsigned long i, n = count / sizeof(*ev);
+	ssize_t ret;
+
+	if (!n)
+		return -EINVAL;
+	if (n > PAGE_SIZE / sizeof(*ev))
+		n = PAGE_SIZE / sizeof(*ev);
+	ev = (void *)__get_free_page(GFP_KERNEL);
+	if (!ev)
+		return -ENOMEM;
+
+	spin_lock_irq(&dev->evlock);
+	while (dev->evseq == rf->evnext) {
+		spin_unlock_irq(&dev->evlock);
+		ret = -EAGAIN;
+		if (nonblock)
+			goto out;
+		ret = -ERESTARTSYS;
+		if (wait_event_interruptible(dev->q, dev->evseq != rf->evnext))
+			goto out;
+		spin_lock_irq(&dev->evlock);
+	}
+	rr_event_catchup(dev, rf);
+	if (n > dev->evseq - rf->evnext)
+		n = dev->evseq - rf->evnext;
+	for (i = 0; i < n; i++)
+		ev[i] = dev->events[(rf->evnext + i) & (RR_NEVENTS - 1)];
+	rf->evnext += n;
+	spin_unlock_irq(&dev->evlock);
+
+	ret = n * sizeof(*ev);
+	if (copy_to_user(buf, ev, ret))
+		ret = -EFAULT;
+ out:
+	free_page((unsigned long)ev);
+	return ret;
+}
+
+/* Like ioctl, read and write are not serialized: see rr_do_iocmd() */
+static ssize_t rr_read(struct file *f, char __user *buf, size_t count,
+		       loff_t *offp)
+{
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
+	ssize_t ret;
+	int idx;
+
+	if (RR_BUF_ID(*offp))
+		return rr_rw_filebuf(rf, buf, count, offp, 0);
+	if (RR_IS_EVENTS(*offp)) /* it sleeps, so not within srcu */
+		return rr_event_read(rf, buf, count, f->f_flags & O_NONBLOCK);
+	if (RR_IS_STREAM(*offp)) /* same */
+		return rr_stream_read(dev, buf, count,
+				      f->f_flags & O_NONBLOCK);
+	idx = srcu_read_lock(&dev->srcu);
+	ret = __rr_read(f, buf, count, offp);
+	srcu_read_unlock(&dev->srcu, idx);
+	return ret;
+}
+
+static ssize_t rr_write(struct file *f, const char __user *buf, size_t count,
+		 loff_t *offp)
+{
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
+	ssize_t ret;
+	int idx;
+
+	if (RR_BUF_ID(*offp))
+		return rr_rw_filebuf(rf, (char __user *)buf, count, offp, 1);
+	idx = srcu_read_lock(&dev->srcu);
+	ret = __rr_write(f, buf, count, offp);
+	srcu_read_unlock(&dev->srcu, idx);
+	return ret;
+}
+
+/*
+ * The file is readable when the stream has slots ready, and it reports
+ * priority data when there are events this file has not read yet.
+ */
+static unsigned int rr_poll(struct file *f, poll_table *wait)
+{
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
+	struct rr_stream *s = &dev->stream;
+	unsigned int mask = 0;
+
+	poll_wait(f, &s->q, wait);
+	poll_wait(f, &dev->q, wait);
+	if (s->producer != s->consumer)
+		mask |= POLLIN | POLLRDNORM;
+	if (dev->evseq != rf->evnext)
+		mask |= POLLPRI;
+	return mask;
+}
+
 static struct file_operations rr_fops = {
 	.open = rr_open,
 	.release = rr_release,
 	.read = rr_read,
 	.write = rr_write,
+	.poll = rr_poll,
 	.mmap = rr_mmap,
 	.unlocked_ioctl = rr_ioctl,
+#ifdef __RR_HAS_URING_CMD
+	.uring_cmd = rr_uring_cmd,
+#endif
 };
 
-/* Registering and unregistering the misc device */
+/* The misc device of the selected board; each board has its own as well */
 static struct miscdevice rr_misc = {
 	.minor = 42,
 	.name = "rawrabbit",
@@ -797,17 +3352,10 @@ static struct miscdevice rr_misc = {
 static int rr_init(void)
 {
 	int ret;
-	struct rr_dev *dev = &rr_dev; /* always use dev as pointer */
-
-	if (rr_bufsize > RR_MAX_BUFSIZE) {
-		printk(KERN_WARNING "rawrabbit: too big a size, using 0x%x\n",
-		       RR_MAX_BUFSIZE);
-		rr_bufsize = RR_MAX_BUFSIZE;
-	}
 
-	dev->dmabuf = __vmalloc(rr_bufsize, GFP_KERNEL | __GFP_ZERO,
-				PAGE_KERNEL);
-	if (!dev->dmabuf)
+	/* /dev/rawrabbit works even with no board, like it always did */
+	rr_nodev = rr_dev_alloc(NUMA_NO_NODE);
+	if (!rr_nodev)
 		return -ENOMEM;
 
 	/* misc device, that's trivial */
@@ -815,35 +3363,40 @@ static int rr_init(void)
 	if (ret < 0) {
 		printk(KERN_ERR "%s: Can't register misc device\n",
 		       KBUILD_MODNAME);
-		return ret;
+		goto out_misc;
 	}
 
 	/* prepare registration of the pci driver according to parameters */
-	dev->devsel->vendor = rr_vendor;
-	dev->devsel->device = rr_device;
-	dev->devsel->subvendor = RR_DEVSEL_UNUSED;
-	dev->devsel->bus = RR_DEVSEL_UNUSED;
+	rr_devsel.vendor = rr_vendor;
+	rr_devsel.device = rr_device;
+	rr_devsel.subvendor = RR_DEVSEL_UNUSED;
+	rr_devsel.bus = RR_DEVSEL_UNUSED;
 
 	/* This function return < 0 on error, 0 on timeout, > 0 on success */
-	ret = rr_fill_table_and_probe(dev);
-	if (ret < 0) {
-		misc_deregister(&rr_misc);
-		return ret;
-	}
+	ret = rr_fill_table_and_probe();
+	if (ret < 0)
+		goto out_probe;
 
 	return 0;
+
+ out_probe:
+	misc_deregister(&rr_misc);
+ out_misc:
+	rr_dev_put(rr_nodev);
+	return ret;
 }
 
 static void rr_exit(void)
 {
-	struct rr_dev *dev = &rr_dev;
-
 	pci_unregister_driver(&rr_pcidrv);
 	misc_deregister(&rr_misc);
-	vfree(dev->dmabuf);
+	rr_dev_put(rr_nodev);
 }
 
 module_init(rr_init);
 module_exit(rr_exit);
 
 MODULE_LICENSE("GPL");
+#ifdef __RR_IMPORT_NS_DMA_BUF
+__RR_IMPORT_NS_DMA_BUF;
+#endif
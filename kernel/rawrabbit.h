@@ -14,9 +14,20 @@
 #include <linux/types.h>
 #include <linux/ioctl.h>
 
+/* Used by both the driver structures and struct rr_irqinfo below */
+#define RR_MAX_VECTORS		8		/* MSI or MSI-X */
+
 #ifdef __KERNEL__ /* The initial part of the file is driver-internal stuff */
 #include <linux/pci.h>
 #include <linux/completion.h>
+#include <linux/scatterlist.h>
+#include <linux/srcu.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/eventfd.h>
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
 #include <linux/workqueue.h>
 #include <linux/firmware.h>
 #include <linux/wait.h>
@@ -24,17 +35,114 @@
 
 struct rr_devsel;
 
+/*
+ * The owner of a transfer: the stack of a synchronous RR_DMA, or the
+ * file for RR_DMA_ASYNC. Filled under the dma lock when the transfer ends
+ */
+struct rr_dmactx {
+	int			 done;
+	u32			 status;	/* GNDMA_STAT_* */
+	u64			 bytes;
+	s64			 nsec;
+	unsigned long		 deadline;	/* jiffies, for RR_DMAWAIT too */
+};
+
+/* A transfer of the DMA engine in BAR0, run one segment at a time */
+struct rr_dma {
+	spinlock_t		 lock;		/* against the irq handler */
+	int			 active;
+	struct sg_table		*sgt;		/* the buffer being used */
+	int			 nents;		/* its mapped segments */
+	unsigned long		 offset, len;	/* the range of the transfer */
+	int			 todevice;
+	struct scatterlist	*sg;		/* next segment to program */
+	unsigned long		 sgoff;		/* offset in this segment */
+	unsigned long		 left;		/* bytes not yet programmed */
+	u32			 devaddr;	/* next device-side address */
+	u32			 curlen;	/* size of the running segment */
+	u64			 bytes;		/* completed */
+	u32			 status;	/* GNDMA_STAT_* at the end */
+	ktime_t			 start, end;
+	struct rr_dmactx	*ctx;		/* while running; NULL if stream */
+	wait_queue_head_t	 q;		/* waiters for any ctx */
+};
+
+/* A ring of slots in the device buffer, filled by the DMA engine */
+struct rr_stream {
+	int			 active;	/* under the dma lock */
+	u32			 slotsize;
+	u32			 nslots;	/* a power of two */
+	u32			 devaddr;
+	unsigned long		 producer;	/* slots filled */
+	unsigned long		 consumer;	/* slots read or dropped */
+	unsigned long		 overruns;	/* slots dropped */
+	struct mutex		 mutex;		/* serializes readers */
+	wait_queue_head_t	 q;
+};
+
+#define RR_NEVENTS		256	/* a power of two */
+
+/* Each interrupt vector (only one for INTx) has its own handler data */
+struct rr_vector {
+	struct rr_dev		*dev;
+	int			 nr;
+	int			 irq;
+	unsigned long		 count;
+	wait_queue_head_t	 q;
+};
+
+/* In-kernel acknowledge of the interrupt (RR_IRQACK) */
+struct rr_ack {
+	int			 enabled;
+	void __iomem		*status;
+	void __iomem		*ack;
+	u32			 mask;
+	u32			 value;
+	u32			 flags;
+};
+
+/* Interrupt moderation: waiters are woken once per batch of events */
+struct rr_mod {
+	u32			 count;		/* 0: no limit */
+	u32			 usecs;		/* 0: no timer */
+	u32			 pending;	/* events not yet delivered */
+	u64			 first, last;	/* their timestamps */
+	struct hrtimer		 timer;
+	u64			 seq;		/* of the last batch delivered */
+	u32			 bcount;	/* and its contents */
+	u64			 bfirst, blast;
+};
+
 struct rr_dev {
 	struct rr_devsel	*devsel;
 	struct pci_driver	*pci_driver;
 	struct pci_device_id	*id_table;
 	struct pci_dev		*pdev;		/* non-null after pciprobe */
 	struct mutex		mutex;
+	struct srcu_struct	 srcu;		/* protects pdev and BARs */
 	wait_queue_head_t	 q;
 	void			*dmabuf;
+	struct page		**vpages;	/* see rr_buf_vzalloc */
+	unsigned long		 bufsize;
+	atomic_t		 dmabuf_maps;	/* user mappings of dmabuf */
+	atomic_t		 dmabuf_exports; /* dma-buf files (RR_EXPORT) */
+	struct sg_table		 sgt;		/* dmabuf pages, for the DMA API */
+	int			 dma_nents;	/* non-zero when mapped */
+	struct list_head	 bufs;		/* rr_buf of all open files */
+	struct rr_dma		 dma;
+	struct rr_stream	 stream;
+	spinlock_t		 evlock;
+	unsigned long		 evseq;		/* of the next event */
+	struct rr_event		*events;	/* RR_NEVENTS, a ring */
+	struct list_head	 evfiles;	/* rr_file with an eventfd */
+	struct rr_mod		 mod;		/* under evlock too */
+	struct rr_latency	*lat;		/* under evlock too */
 	char			*fwname;
-	struct timespec		 irqtime;
+	ktime_t			 irqstamp;	/* of the last interrupt */
 	unsigned long		 irqcount;
+	struct rr_vector	 vec[RR_MAX_VECTORS];
+	int			 nvec;		/* requested */
+	struct rr_ack		 ack;
 	struct completion	 complete;
 	struct resource		*area[3];	/* bar 0, 2, 4 */
 	void			*remap[3];	/* ioremap of bar 0, 2, 4 */
@@ -44,21 +152,65 @@ struct rr_dev {
 	struct completion	 fw_load;
 	void			(*load_program)(struct rr_dev *); /* lm32 */
 	int			 usecount;
-#ifdef IS_SPEC_DEMO
+	struct kref		 kref;		/* the board, and open files */
+	int			 node;		/* NUMA node of the board */
 	struct miscdevice	 misc;
-	char			 miscname[32]; /* "spec-demo-<bus>-<slot> */
+	char			 miscname[32]; /* "rawrabbit-<bus>-<slot> */
 	struct list_head	 list;
-#endif
+};
+
+/* Each open file has its own state, and f->private_data points here */
+struct rr_file {
+	struct rr_dev		*dev;
+	struct list_head	 prevdevs;	/* left by RR_DEVSEL, see below */
+	int			 width;	/* bulk read/write access size */
+	struct mutex		 lock;	/* protects bufs; before dev->mutex */
+	struct list_head	 bufs;
+	int			 nbufs;
+	u32			 lastid;
+	unsigned long		 evnext;	/* next event to read */
+	unsigned long		 evoverruns;	/* events lost by this file */
+	u64			 batchseq;	/* last batch returned */
+	struct eventfd_ctx	*evfd;		/* signalled at each batch */
+	struct list_head	 evlist;	/* in dev->evfiles, if evfd */
+	struct rr_dev		*dmadev;	/* of the last RR_DMA_ASYNC */
+	struct rr_dmactx	 dmactx;	/* and its result */
+};
+
+/* A board a file was moved away from: referenced until the file is closed */
+struct rr_prevdev {
+	struct list_head	 list;		/* in the rr_file, under its lock */
+	struct rr_dev		*dev;
+};
+
+/* A DMA buffer owned by an open file (RR_BUFALLOC or RR_BUFPIN) */
+struct rr_buf {
+	struct list_head	 list;		/* in the rr_file, under its lock */
+	struct list_head	 devlist;	/* in the rr_dev, under its mutex */
+	u32			 id;
+	void			*addr;		/* vmalloc, NULL if pinned */
+	struct page		**vpages;	/* see rr_buf_vzalloc */
+	struct page		**pages;	/* pinned user pages, or NULL */
+	int			 npages;
+	unsigned long		 offset;	/* of user data in the first page */
+	unsigned long		 size;
+	atomic_t		 maps;		/* user mappings */
+	struct sg_table		 sgt;
+	int			 nents;		/* non-zero when mapped */
 };
 
 extern char *rr_fwname; /* module parameter. If "" then defaults apply */
 
 #define RR_FLAG_REGISTERED	0x00000001
 #define RR_FLAG_IRQDISABLE	0x00000002
-#define RR_FLAG_IRQREQUEST	0x00000002
+#define RR_FLAG_IRQREQUEST	0x00000004
+#define RR_FLAG_MISC		0x00000008	/* misc registered */
 
 
 #define RR_PROBE_TIMEOUT	(HZ)		/* for pci_register_drv */
+#define RR_IOV_CHUNK		128		/* iocmd copied at a time */
+#define RR_DMA_TIMEOUT		(HZ)		/* for a transfer, plus... */
+#define RR_DMA_MIN_RATE		(16 << 20)	/* ...its length at 16MB/s */
 
 /* These two live in ./loader.c */
 extern void rr_ask_firmware(struct rr_dev *dev);
@@ -76,9 +228,10 @@ extern void spec_ask_program(struct rr_dev *dev);
 #define RR_DEFAULT_FWNAME	"rrabbit-%P-%p@%b"
 #define RR_MAX_FWNAME_SIZE	64
 #define RR_DEFAULT_BUFSIZE	(1<<20)		/* 1MB */
+#define RR_DEFAULT_WIDTH	4		/* bulk read/write: 32 bits */
 #define RR_PLIST_SIZE		4096		/* no PAGE_SIZE in user space */
 #define RR_PLIST_LEN		(RR_PLIST_SIZE / sizeof(void *))
-#define RR_MAX_BUFSIZE		(RR_PLIST_SIZE * RR_PLIST_LEN)
+#define RR_MAX_BUFSIZE		(RR_PLIST_SIZE * RR_PLIST_LEN) /* for GETPLIST */
 
 
 /* This structure is used to select the device to be accessed, via ioctl */
@@ -98,10 +251,14 @@ struct rr_devsel {
 #define RR_BAR_2		0x20000000
 #define RR_BAR_4		0x40000000
 #define RR_BAR_BUF		0xc0000000	/* The DMA buffer */
+#define RR_BAR_STREAM		0xd0000000	/* Its slots, see RR_STREAMON */
+#define RR_BAR_EVENTS		0xe0000000	/* struct rr_event records */
 #define RR_IS_DMABUF(addr)	((addr) >= RR_BAR_BUF)
 #define __RR_GET_BAR(x)		((x) >> 28)
 #define __RR_SET_BAR(x)		((x) << 28)
 #define __RR_GET_OFF(x)		((x) & 0x0fffffff)
+#define RR_IS_STREAM(addr)	(__RR_GET_BAR(addr) == 0x0d)
+#define RR_IS_EVENTS(addr)	(__RR_GET_BAR(addr) == 0x0e)
 
 static inline int rr_is_valid_bar(unsigned long address)
 {
@@ -126,6 +283,231 @@ struct rr_iocmd {
 	};
 };
 
+/* Vectored access: nr commands of the same type, with a single system call */
+struct rr_iov {
+	__u32 cmd;	/* RR_READ or RR_WRITE, for all entries */
+	__u32 nr;	/* number of entries */
+	__u64 iocmd;	/* pointer to an array of nr struct rr_iocmd */
+	__u64 status;	/* pointer to nr __s32 (0 or -errno), may be 0 */
+};
+
+/*
+ * A sequence is a small program of 32-bit register operations, run by
+ * the driver under the device lock: other sequences can't interleave,
+ * but plain RR_READ and RR_WRITE can. Skips are only forward, so it ends.
+ */
+struct rr_seqop {
+	__u16 op;	/* RR_SEQ_READ etc, see below */
+	__u16 skip;	/* for RR_SEQ_SKIPEQ and RR_SEQ_SKIPNE */
+	__u32 address;	/* bar and offset, as in rr_iocmd */
+	__u32 mask;
+	__u32 value;
+};
+
+enum rr_seq_opcodes {
+	RR_SEQ_READ = 0,	/* store the register in the values array */
+	RR_SEQ_WRITE,		/* write "value" */
+	RR_SEQ_RMW,		/* replace "mask" bits with "value" */
+	RR_SEQ_DELAY,		/* wait "value" microseconds */
+	RR_SEQ_SKIPEQ,		/* skip "skip" ops if (reg & mask) == value */
+	RR_SEQ_SKIPNE,		/* skip "skip" ops if (reg & mask) != value */
+};
+
+struct rr_seq {
+	__u32 nops;	/* number of operations */
+	__u32 nvalues;	/* size of the values array */
+	__u64 ops;	/* pointer to nops struct rr_seqop */
+	__u64 values;	/* pointer to nvalues __u32, filled by RR_SEQ_READ */
+	__u32 done;	/* returned: number of operations executed */
+	__u32 collected;/* returned: number of values stored */
+};
+
+#define RR_SEQ_MAX_OPS		1024
+#define RR_SEQ_MAX_DELAY	1000000	/* usecs, for a single op */
+#define RR_SEQ_MAX_TOTAL_DELAY	1000000	/* usecs, for the whole sequence */
+
+/* Bus addresses of the DMA buffer, as mapped by the DMA API */
+struct rr_dmaseg {
+	__u64 addr;
+	__u64 len;
+};
+
+struct rr_dmalist {
+	__u32 first;	/* first segment to return */
+	__u32 nseg;	/* in: size of the array; out: segments returned */
+	__u32 total;	/* out: total number of segments */
+	__u32 id;	/* 0 for the device buffer, or as RR_BUFALLOC */
+	__u64 segs;	/* pointer to nseg struct rr_dmaseg */
+};
+
+#define RR_DMASYNC_CPU		0	/* argument of RR_DMASYNC */
+#define RR_DMASYNC_DEVICE	1
+
+/*
+ * Each open file can allocate its own DMA buffers, freed on close.
+ * A buffer is read, written and mapped at RR_BUF_OFFSET(id) in the file.
+ */
+struct rr_bufreq {
+	__u32 id;	/* returned by RR_BUFALLOC, passed to the others */
+	__u32 flags;	/* RR_BUFSYNC: RR_DMASYNC_CPU or RR_DMASYNC_DEVICE */
+	__u64 size;	/* RR_BUFALLOC: in, rounded to pages; RR_BUFINFO: out */
+	__u64 offset;	/* out: file offset for read, write and mmap */
+};
+
+#define RR_BUF_PINNED		1	/* RR_BUFINFO flags: from RR_BUFPIN */
+
+/*
+ * Memory of the application can be pinned and mapped for DMA instead,
+ * so the device writes to it with no copy. It gets an id like the
+ * allocated buffers, for RR_DMA and the others, but it is not read,
+ * written or mapped through the file. The bus addresses are returned
+ * in the list, if segs is set, like RR_GETDMALIST does.
+ */
+struct rr_bufpin {
+	__u64 addr;	/* user virtual address, 4-aligned */
+	__u64 size;	/* a multiple of 4 */
+	struct rr_dmalist list; /* id is returned, the rest as RR_GETDMALIST */
+};
+
+/*
+ * A transfer of the DMA engine in the gateware, between a buffer
+ * (0 or as RR_BUFALLOC) and the device-side address space.
+ */
+struct rr_dmareq {
+	__u32 id;	/* the buffer, 0 for the device buffer */
+	__u32 flags;	/* RR_DMA_TODEVICE, RR_DMA_ASYNC */
+	__u64 offset;	/* in the buffer */
+	__u64 len;	/* bytes; offset, len and devaddr are 4-aligned */
+	__u32 devaddr;	/* device-side address */
+	__u32 status;	/* out: GNDMA_STAT_* */
+	__u64 bytes;	/* out: bytes transferred */
+	__u64 nsec;	/* out: time from start to completion */
+};
+
+#define RR_DMA_TODEVICE		0x00000001	/* else from device to host */
+#define RR_DMA_ASYNC		0x00000002	/* don't wait: use RR_DMAWAIT */
+
+/*
+ * Streaming: the DMA engine fills the slots of the device buffer in a
+ * loop, and read() at RR_BAR_STREAM returns them in order.
+ */
+struct rr_streamreq {
+	__u32 slotsize;	/* bytes, a multiple of 4 */
+	__u32 nslots;	/* a power of two; all slots fit the device buffer */
+	__u32 devaddr;	/* device-side address, the same for each slot */
+	__u32 flags;	/* out: RR_STREAM_ACTIVE */
+	__u64 produced;	/* out: slots filled so far */
+	__u64 consumed;	/* out: slots read or dropped */
+	__u64 overruns;	/* out: slots dropped, as the reader was late */
+};
+
+#define RR_STREAM_ACTIVE	0x00000001
+
+/*
+ * Interrupts are recorded in a ring, and each open file reads all of
+ * them at RR_BAR_EVENTS. A gap in the sequence numbers means overrun.
+ */
+struct rr_event {
+	__u64 seq;
+	__u64 nsec;	/* monotonic time of the interrupt */
+	__u32 source;	/* RR_EVENT_IRQ etc */
+	__u32 unused;
+};
+
+enum rr_event_sources {
+	RR_EVENT_IRQ = 0,	/* the interrupt, now disabled (RR_IRQENA) */
+	RR_EVENT_DMA,		/* end of a transfer of the DMA engine */
+	RR_EVENT_VECTOR = 0x100,/* plus the number, for vectors but the first */
+};
+
+/* The interrupt vectors in use, and how many times each one fired */
+struct rr_irqinfo {
+	__u32 nvec;	/* 0 if no interrupt is available */
+	__u32 type;	/* RR_IRQ_INTX etc */
+	__u64 count[RR_MAX_VECTORS];
+};
+
+/*
+ * The driver can acknowledge the interrupt by itself, so it is not
+ * disabled: the status register tells whether the board is interrupting.
+ */
+struct rr_irqack {
+	__u32 status;	/* bar and offset, as in rr_iocmd; 32-bit access */
+	__u32 mask;	/* the interrupt is ours if (status & mask) */
+	__u32 ack;	/* bar and offset of the register to write */
+	__u32 value;	/* the value to write, unless RR_IRQACK_STATUS */
+	__u32 flags;
+};
+
+#define RR_IRQACK_ENABLE	0x00000001	/* else back to disable/IRQENA */
+#define RR_IRQACK_STATUS	0x00000002	/* write (status & mask) */
+#define RR_IRQACK_NOWRITE	0x00000004	/* status is cleared on read */
+
+#define RR_IRQ_INTX		0
+#define RR_IRQ_MSI		1
+#define RR_IRQ_MSIX		2
+
+/*
+ * Wakeups can be coalesced (RR_IRQMOD): each batch reports how many
+ * events were delivered with it, and when the first and last happened.
+ */
+struct rr_irqmod {
+	__u32 count;	/* wake after so many events; 0 for no limit */
+	__u32 usecs;	/* or this long after the first; 0 for no limit */
+};
+
+#define RR_IRQMOD_MAX_USECS	1000000
+
+struct rr_irqbatch {
+	__u64 seq;	/* of the batch: a gap means a batch was not read */
+	__u32 count;
+	__u32 unused;
+	__u64 first;	/* monotonic nanoseconds, like struct rr_event */
+	__u64 last;
+};
+
+/*
+ * Latency histograms (RR_LATENCY), from the interrupt handler to the
+ * wakeup of RR_IRQWAIT and to the acknowledge (in the handler itself,
+ * after RR_IRQACK, or by RR_IRQENA). Bucket n counts latencies of
+ * 2^n to 2^(n+1)-1 ns, the last one counts everything longer.
+ */
+#define RR_HIST_BUCKETS		32
+
+struct rr_hist {
+	__u64 count;
+	__u64 min, max, sum;	/* nanoseconds */
+	__u32 bucket[RR_HIST_BUCKETS];
+};
+
+struct rr_latency {
+	__u32 flags;		/* RR_LATENCY_RESET, set by user space */
+	__u32 unused;
+	struct rr_hist wakeup;
+	struct rr_hist ack;
+};
+
+#define RR_LATENCY_RESET	1	/* clear after returning them */
+
+struct rr_evstat {
+	__u64 seq;	/* of the next event to happen */
+	__u64 next;	/* of the next event this file will read */
+	__u64 overruns;	/* events this file lost */
+};
+
+/*
+ * With io_uring, cmd_op of IORING_OP_URING_CMD is the ioctl number,
+ * and the command area of the sqe is this structure
+ */
+struct rr_uring_cmd {
+	__u64 arg;	/* the third argument of ioctl: a pointer or a number */
+	__u64 unused;
+};
+
+#define RR_MAX_FILEBUFS		16
+#define RR_BUF_OFFSET(id)	((__u64)(id) << 32)
+#define RR_BUF_ID(offset)	((__u64)(offset) >> 32)
+
 /* ioctl commands */
 #define __RR_IOC_MAGIC '4' /* random or so */
 
@@ -136,8 +518,33 @@ struct rr_iocmd {
 #define RR_IRQWAIT	  _IO(__RR_IOC_MAGIC, 4)
 #define RR_IRQENA	  _IO(__RR_IOC_MAGIC, 5)
 #define RR_GETDMASIZE	  _IO(__RR_IOC_MAGIC, 6)
-/* #define RR_SETDMASIZE	  _IO(__RR_IOC_MAGIC, 7, unsigned long) */
+#define RR_SETDMASIZE	  _IO(__RR_IOC_MAGIC, 7) /* size as argument */
 #define RR_GETPLIST	  _IO(__RR_IOC_MAGIC, 8) /* returns a whole page */
+#define RR_IOV		 _IOW(__RR_IOC_MAGIC, 9, struct rr_iov)
+#define RR_SEQ		_IOWR(__RR_IOC_MAGIC, 10, struct rr_seq)
+#define RR_SETWIDTH	  _IO(__RR_IOC_MAGIC, 11) /* 1,2,4,8; 0 to query */
+#define RR_GETDMALIST	_IOWR(__RR_IOC_MAGIC, 12, struct rr_dmalist)
+#define RR_DMASYNC	  _IO(__RR_IOC_MAGIC, 13) /* RR_DMASYNC_CPU etc */
+#define RR_BUFALLOC	_IOWR(__RR_IOC_MAGIC, 14, struct rr_bufreq)
+#define RR_BUFFREE	  _IO(__RR_IOC_MAGIC, 15) /* id as argument */
+#define RR_BUFINFO	_IOWR(__RR_IOC_MAGIC, 16, struct rr_bufreq)
+#define RR_BUFSYNC	 _IOW(__RR_IOC_MAGIC, 17, struct rr_bufreq)
+#define RR_DMA		_IOWR(__RR_IOC_MAGIC, 18, struct rr_dmareq)
+#define RR_DMAWAIT	 _IOR(__RR_IOC_MAGIC, 19, struct rr_dmareq)
+#define RR_STREAMON	 _IOW(__RR_IOC_MAGIC, 20, struct rr_streamreq)
+#define RR_STREAMOFF	  _IO(__RR_IOC_MAGIC, 21)
+#define RR_STREAMSTAT	 _IOR(__RR_IOC_MAGIC, 22, struct rr_streamreq)
+#define RR_EVSTAT	 _IOR(__RR_IOC_MAGIC, 23, struct rr_evstat)
+#define RR_EVENTFD	  _IO(__RR_IOC_MAGIC, 24) /* eventfd, or -1 */
+#define RR_IRQINFO	 _IOR(__RR_IOC_MAGIC, 25, struct rr_irqinfo)
+#define RR_VECWAIT	  _IO(__RR_IOC_MAGIC, 26) /* vector number */
+#define RR_IRQACK	 _IOW(__RR_IOC_MAGIC, 27, struct rr_irqack)
+#define RR_IRQMOD	 _IOW(__RR_IOC_MAGIC, 28, struct rr_irqmod)
+#define RR_IRQBATCH	 _IOR(__RR_IOC_MAGIC, 29, struct rr_irqbatch)
+#define RR_LATENCY	_IOWR(__RR_IOC_MAGIC, 30, struct rr_latency)
+#define RR_BUFPIN	_IOWR(__RR_IOC_MAGIC, 31, struct rr_bufpin)
+#define RR_BUFUNPIN	  _IO(__RR_IOC_MAGIC, 32) /* id as argument */
+#define RR_EXPORT	  _IO(__RR_IOC_MAGIC, 33) /* O_CLOEXEC or 0 */
 
 
 #define VFAT_IOCTL_READDIR_BOTH         _IOR('r', 1, struct dirent [2])
@@ -149,6 +556,7 @@ enum {
 	GNGPIO_OUTPUT_ENABLE = GNGPIO_BASE + 0x8,
 	GNGPIO_OUTPUT_VALUE = GNGPIO_BASE + 0xC,
 	GNGPIO_INPUT_VALUE = GNGPIO_BASE + 0x10,
+	GNGPIO_INT_STATUS = GNGPIO_BASE + 0x20,	/* cleared on read */
 
 	FCL_BASE	= 0xB00,
 	FCL_CTRL	= FCL_BASE,
@@ -169,5 +577,30 @@ enum {
 	PCI_SYS_CFG_SYSTEM = 0x800
 };
 
+/* The DMA engine of the gn4124 core in the gateware, in BAR0 */
+enum {
+	GNDMA_CTRL	= 0x00,
+	GNDMA_STAT	= 0x04,
+	GNDMA_CSTART	= 0x08,		/* device-side address */
+	GNDMA_HSTARTL	= 0x0c,		/* host (bus) address */
+	GNDMA_HSTARTH	= 0x10,
+	GNDMA_LEN	= 0x14,
+	GNDMA_NEXTL	= 0x18,		/* next item, when chained */
+	GNDMA_NEXTH	= 0x1c,
+	GNDMA_ATTRIB	= 0x20,
+
+	GNDMA_CTRL_START = 0x1,
+	GNDMA_CTRL_ABORT = 0x2,
+
+	GNDMA_STAT_IDLE = 0,
+	GNDMA_STAT_DONE,
+	GNDMA_STAT_BUSY,
+	GNDMA_STAT_ERROR,
+	GNDMA_STAT_ABORTED,
+
+	GNDMA_ATTRIB_CHAIN = 0x1,	/* more items follow */
+	GNDMA_ATTRIB_TODEVICE = 0x2,	/* from host memory to device */
+};
+
 #endif /* __RAWRABBIT_H__ */
 
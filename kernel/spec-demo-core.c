@@ -26,7 +26,9 @@
 #include <linux/vmalloc.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
-#include <asm/uaccess.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/uaccess.h>
 
 #define IS_SPEC_DEMO /* hack! */
 #include "rawrabbit.h"
@@ -89,21 +91,24 @@ static int rr_pciprobe (struct pci_dev *pdev, const struct pci_device_id *id)
 
 	printk("%s: %i %i\n", __func__, pdev->bus->number, pdev->devfn);
 	printk("%s: current %i (%s)\n", __func__, current->pid, current->comm);
-	dev = kmalloc(sizeof(*dev), GFP_KERNEL);
+	/* allocate on the node of the board, as it does DMA to the buffer */
+	dev = kmalloc_node(sizeof(*dev), GFP_KERNEL, dev_to_node(&pdev->dev));
 	if (!dev)
 		return -ENOMEM;
-	dev->dmabuf = __vmalloc(rr_bufsize, GFP_KERNEL | __GFP_ZERO,
-				PAGE_KERNEL);
+
+	/* So, we have a new device: init it and create its misc device */
+	rr_dev_template.misc.minor++;
+	*dev = rr_dev_template;
+	dev->node = dev_to_node(&pdev->dev);
+
+	/* allocate after copying the template, or the pointer is lost */
+	dev->dmabuf = vzalloc_node(rr_bufsize, dev->node);
 	if (!dev->dmabuf) {
 		kfree(dev);
 		return -ENOMEM;
 	}
 	if (!rr_first_dev)
 		rr_first_dev = dev;
-
-	/* So, we have a new device: init it and create its misc device */
-	rr_dev_template.misc.minor++;
-	*dev = rr_dev_template;
 	init_waitqueue_head(&dev->q);
 	mutex_init(&dev->mutex);
 	INIT_WORK(&dev->work, rr_load_firmware);
@@ -465,13 +470,164 @@ static int rr_do_iocmd(struct rr_dev *dev, unsigned int cmd,
 	return -EIO;
 }
 
+/*
+ * Vectored access: run all commands through rr_do_iocmd(), under the
+ * lock already taken by the caller. The return value is the number of
+ * failed commands, whose error is reported in the status array.
+ */
+static int rr_do_iov(struct rr_dev *dev, struct rr_iov *iov)
+{
+	struct rr_iocmd __user *ucmd = (void __user *)(long)iov->iocmd;
+	s32 __user *ustatus = (void __user *)(long)iov->status;
+	struct rr_iocmd *kcmd;
+	s32 *kstatus;
+	unsigned int i, n, done;
+	int errors = 0;
+
+	if (iov->cmd != RR_READ && iov->cmd != RR_WRITE)
+		return -EINVAL;
+	kcmd = kmalloc(RR_IOV_CHUNK * (sizeof(*kcmd) + sizeof(*kstatus)),
+		       GFP_KERNEL);
+	if (!kcmd)
+		return -ENOMEM;
+	kstatus = (s32 *)(kcmd + RR_IOV_CHUNK);
+
+	for (done = 0; done < iov->nr; done += n) {
+		n = min_t(unsigned int, iov->nr - done, RR_IOV_CHUNK);
+		if (copy_from_user(kcmd, ucmd + done, n * sizeof(*kcmd))) {
+			errors = -EFAULT;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			kstatus[i] = rr_do_iocmd(dev, iov->cmd, kcmd + i);
+			if (kstatus[i])
+				errors++;
+		}
+		if (iov->cmd == RR_READ
+		    && copy_to_user(ucmd + done, kcmd, n * sizeof(*kcmd))) {
+			errors = -EFAULT;
+			break;
+		}
+		if (ustatus
+		    && copy_to_user(ustatus + done, kstatus,
+				    n * sizeof(*kstatus))) {
+			errors = -EFAULT;
+			break;
+		}
+	}
+	kfree(kcmd);
+	return errors;
+}
+
+/*
+ * Run a sequence of register operations, under the lock already taken
+ * by the caller. On error, seq->done tells which operation failed.
+ */
+static int rr_do_seq(struct rr_dev *dev, struct rr_seq *seq)
+{
+	struct rr_seqop *ops, *op;
+	struct rr_iocmd iocmd;
+	unsigned int skip;
+	u64 delay = 0;
+	u32 *values;
+	int ret = 0, match;
+
+	seq->done = seq->collected = 0;
+	if (seq->nops > RR_SEQ_MAX_OPS)
+		return -E2BIG;
+	if (seq->nvalues > seq->nops)
+		seq->nvalues = seq->nops; /* can't collect more than that */
+	ops = kmalloc(seq->nops * (sizeof(*ops) + sizeof(*values)),
+		      GFP_KERNEL);
+	if (!ops)
+		return -ENOMEM;
+	values = (u32 *)(ops + seq->nops);
+	if (copy_from_user(ops, (void __user *)(long)seq->ops,
+			   seq->nops * sizeof(*ops))) {
+		kfree(ops);
+		return -EFAULT;
+	}
+	/* the device lock is held throughout: limit the sum of delays */
+	for (op = ops; op < ops + seq->nops; op++)
+		if (op->op == RR_SEQ_DELAY)
+			delay += op->value;
+	if (delay > RR_SEQ_MAX_TOTAL_DELAY) {
+		kfree(ops);
+		return -EINVAL;
+	}
+
+	iocmd.datasize = 4;
+	for (op = ops; op < ops + seq->nops; op++, seq->done++) {
+		iocmd.address = op->address;
+		if (op->op != RR_SEQ_WRITE && op->op != RR_SEQ_DELAY) {
+			/* all others start by reading the register */
+			ret = rr_do_iocmd(dev, RR_READ, &iocmd);
+			if (ret)
+				break;
+		}
+		switch(op->op) {
+		case RR_SEQ_READ:
+			if (seq->collected == seq->nvalues) {
+				ret = -ENOSPC;
+				break;
+			}
+			values[seq->collected++] = iocmd.data32;
+			break;
+		case RR_SEQ_WRITE:
+			iocmd.data32 = op->value;
+			ret = rr_do_iocmd(dev, RR_WRITE, &iocmd);
+			break;
+		case RR_SEQ_RMW:
+			iocmd.data32 &= ~op->mask;
+			iocmd.data32 |= op->value & op->mask;
+			ret = rr_do_iocmd(dev, RR_WRITE, &iocmd);
+			break;
+		case RR_SEQ_DELAY:
+			if (op->value > RR_SEQ_MAX_DELAY)
+				ret = -EINVAL;
+			else if (op->value < 1000)
+				udelay(op->value);
+			else
+				msleep(op->value / 1000);
+			break;
+		case RR_SEQ_SKIPEQ:
+		case RR_SEQ_SKIPNE:
+			match = (iocmd.data32 & op->mask) == op->value;
+			if (op->op == RR_SEQ_SKIPNE)
+				match = !match;
+			if (!match)
+				break;
+			/* skipped operations are counted as done */
+			skip = op->skip;
+			if (skip > ops + seq->nops - op - 1) {
+				ret = -EINVAL;
+				break;
+			}
+			op += skip;
+			seq->done += skip;
+			break;
+		default:
+			ret = -EINVAL;
+		}
+		if (ret)
+			break;
+	}
+
+	if (seq->collected
+	    && copy_to_user((void __user *)(long)seq->values, values,
+			    seq->collected * sizeof(*values)))
+		ret = -EFAULT;
+	kfree(ops);
+	return ret;
+}
 
 /*
  * The ioctl method is the one used for strange stuff (see docs)
  */
 static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
-	struct rr_dev *dev = f->private_data;
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
 	int size = _IOC_SIZE(cmd); /* the size bitfield in cmd */
 	int ret = 0;
 	void *addr;
@@ -481,6 +637,8 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	union {
 		struct rr_iocmd iocmd;
 		struct rr_devsel devsel;
+		struct rr_iov iov;
+		struct rr_seq seq;
 	} karg;
 
 	/*
@@ -497,11 +655,11 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	 * "write" is reversed
 	 */
 	if (_IOC_DIR(cmd) & _IOC_READ) {
-		if (!access_ok(VERIFY_WRITE, (void *)arg, size))
+		if (!__RR_ACCESS_OK(VERIFY_WRITE, (void __user *)arg, size))
 			return -EFAULT;
 	}
 	else if (_IOC_DIR(cmd) & _IOC_WRITE) {
-		if (!access_ok(VERIFY_READ, (void *)arg, size))
+		if (!__RR_ACCESS_OK(VERIFY_READ, (void __user *)arg, size))
 			return -EFAULT;
 	}
 
@@ -520,6 +678,27 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 		ret = rr_do_iocmd(dev, cmd, &karg.iocmd);
 		break;
 
+	case RR_IOV:	/* Several reads or writes with a single lock */
+		ret = rr_do_iov(dev, &karg.iov);
+		break;
+
+	case RR_SEQ:	/* Run a sequence of operations atomically */
+		ret = rr_do_seq(dev, &karg.seq);
+		/* on error the generic copy is skipped, but report progress */
+		if (ret < 0 && copy_to_user((void *)arg, &karg, size))
+			ret = -EFAULT;
+		break;
+
+	case RR_SETWIDTH:	/* Access size for bulk read and write */
+		if (arg != 0 && arg != 1 && arg != 2 && arg != 4 && arg != 8) {
+			ret = -EINVAL;
+			break;
+		}
+		if (arg)
+			rf->width = arg;
+		ret = rf->width;
+		break;
+
 	case RR_GETDMASIZE:	/* Return the current dma size */
 		ret = rr_bufsize;
 		break;
@@ -532,7 +711,8 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 			__page_size_is_not_4096(); /* undefined symbol */
 		}
 
-		if (!access_ok(VERIFY_WRITE, arg, RR_PLIST_SIZE)) {
+		if (!__RR_ACCESS_OK(VERIFY_WRITE, (void __user *)arg,
+				    RR_PLIST_SIZE)) {
 			ret = -EFAULT;
 			break;
 		}
@@ -566,27 +746,23 @@ static long rr_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
  */
 static int rr_open(struct inode *ino, struct file *f)
 {
-	struct rr_dev *dev = NULL;
-	struct list_head *lptr;
-	int minor = iminor(ino);
-
-	printk("open for minor %i\n", minor);
+	struct rr_dev *dev;
+	struct rr_file *rf;
 
-	if (minor == RR_SINGLE_MINOR) {
+	/* misc_open set private_data to our miscdevice: no need to search */
+	if (f->private_data == &rr_single_misc) {
 		dev = rr_first_dev;
 		if (!dev)
 			return -ENODEV;
 	} else {
-		/* look for this minor in the list */
-		list_for_each(lptr, &rr_dev_list) {
-			dev = container_of(lptr, struct rr_dev, list);
-			if (dev->misc.minor != minor)
-				continue;
-		}
-		if (dev && dev->misc.minor != minor)
-			return -ENODEV;
+		dev = container_of(f->private_data, struct rr_dev, misc);
 	}
-	f->private_data = dev;
+	rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+	if (!rf)
+		return -ENOMEM;
+	rf->dev = dev;
+	rf->width = RR_DEFAULT_WIDTH;
+	f->private_data = rf;
 
 	mutex_lock(&dev->mutex);
 	dev->usecount++;
@@ -597,27 +773,170 @@ static int rr_open(struct inode *ino, struct file *f)
 
 static int rr_release(struct inode *ino, struct file *f)
 {
-	struct rr_dev *dev = f->private_data;
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
 
 	mutex_lock(&dev->mutex);
 	dev->usecount--;
 	mutex_unlock(&dev->mutex);
 
+	kfree(rf);
+	return 0;
+}
+
+/*
+ * The DMA buffer is vmalloc memory: insert its pages one by one, so
+ * user space shares the same pages that RR_GETPLIST returns.
+ */
+static int rr_mmap_dmabuf(struct rr_dev *dev, struct vm_area_struct *vma,
+			  unsigned long off, unsigned long size)
+{
+	unsigned long uaddr = vma->vm_start;
+	int ret;
+
+	if (off >= rr_bufsize || size > rr_bufsize - off)
+		return -ENXIO;
+	vm_flags_set(vma, VM_RESERVED);
+	for (; uaddr < vma->vm_end; uaddr += PAGE_SIZE, off += PAGE_SIZE) {
+		ret = vm_insert_page(vma, uaddr,
+				     vmalloc_to_page(dev->dmabuf + off));
+		if (ret)
+			return ret;
+	}
 	return 0;
 }
 
+/*
+ * Only the DMA buffer can be mapped here: mappings of the BARs would
+ * outlive the board on remove, and this driver has no way to revoke
+ * them (rawrabbit does, see rr_bar_vm_fault there).
+ */
 static int rr_mmap(struct file *f, struct vm_area_struct *vma)
 {
-	return -EOPNOTSUPP;
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
+	unsigned long pos = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!rr_is_dmabuf_bar(pos))
+		return -EOPNOTSUPP;
+
+	mutex_lock(&dev->mutex);
+	ret = rr_mmap_dmabuf(dev, vma, __RR_GET_OFF(pos), size);
+	mutex_unlock(&dev->mutex);
+	return ret;
+}
+
+/*
+ * Bulk transfers to I/O memory use sized accesses (the width of the
+ * file, set by RR_SETWIDTH) through a bounce buffer, one page at a time.
+ */
+static void rr_ioread(void *dst, void __iomem *src, size_t count, int width)
+{
+	void *end = dst + count;
+
+	switch(width) {
+	case 1:
+		for (; dst < end; dst += 1, src += 1)
+			*(u8 *)dst = readb(src);
+		break;
+	case 2:
+		for (; dst < end; dst += 2, src += 2)
+			*(u16 *)dst = readw(src);
+		break;
+	case 4:
+		for (; dst < end; dst += 4, src += 4)
+			*(u32 *)dst = readl(src);
+		break;
+	case 8:
+		for (; dst < end; dst += 8, src += 8)
+			*(u64 *)dst = readq(src);
+		break;
+	}
+}
+
+static void rr_iowrite(void __iomem *dst, void *src, size_t count, int width)
+{
+	void *end = src + count;
+
+	switch(width) {
+	case 1:
+		for (; src < end; dst += 1, src += 1)
+			writeb(*(u8 *)src, dst);
+		break;
+	case 2:
+		for (; src < end; dst += 2, src += 2)
+			writew(*(u16 *)src, dst);
+		break;
+	case 4:
+		for (; src < end; dst += 4, src += 4)
+			writel(*(u32 *)src, dst);
+		break;
+	case 8:
+		for (; src < end; dst += 8, src += 8)
+			writeq(*(u64 *)src, dst);
+		break;
+	}
+}
+
+static ssize_t rr_read_bulk(char __user *buf, void __iomem *addr,
+			    size_t count, int width)
+{
+	void *bounce;
+	size_t done, n;
+	ssize_t ret = 0;
+
+	if (((unsigned long)addr | count) & (width - 1))
+		return -EIO;
+	bounce = (void *)__get_free_page(GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+	for (done = 0; done < count; done += n) {
+		n = min_t(size_t, count - done, PAGE_SIZE);
+		rr_ioread(bounce, addr + done, n, width);
+		if (copy_to_user(buf + done, bounce, n)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	free_page((unsigned long)bounce);
+	return done ? done : ret;
+}
+
+static ssize_t rr_write_bulk(void __iomem *addr, const char __user *buf,
+			     size_t count, int width)
+{
+	void *bounce;
+	size_t done, n;
+	ssize_t ret = 0;
+
+	if (((unsigned long)addr | count) & (width - 1))
+		return -EIO;
+	bounce = (void *)__get_free_page(GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+	for (done = 0; done < count; done += n) {
+		n = min_t(size_t, count - done, PAGE_SIZE);
+		if (copy_from_user(bounce, buf + done, n)) {
+			ret = -EFAULT;
+			break;
+		}
+		rr_iowrite(addr + done, bounce, n, width);
+	}
+	free_page((unsigned long)bounce);
+	return done ? done : ret;
 }
 
 static ssize_t rr_read(struct file *f, char __user *buf, size_t count,
 		       loff_t *offp)
 {
-	struct rr_dev *dev = f->private_data;
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
 	void *base;
 	loff_t pos = *offp;
 	int bar, off, size;
+	ssize_t ret;
 
 	bar = __RR_GET_BAR(pos) / 2; /* index in the array */
 	off = __RR_GET_OFF(pos);
@@ -669,8 +988,10 @@ static ssize_t rr_read(struct file *f, char __user *buf, size_t count,
 			return -EFAULT;
 		break;
 	default:
-		if (copy_to_user(buf, base + off, count))
-			return -EFAULT;
+		ret = rr_read_bulk(buf, base + off, count, rf->width);
+		if (ret < 0)
+			return ret;
+		count = ret;
 	}
 	*offp += count;
 	return count;
@@ -679,10 +1000,12 @@ static ssize_t rr_read(struct file *f, char __user *buf, size_t count,
 static ssize_t rr_write(struct file *f, const char __user *buf, size_t count,
 		 loff_t *offp)
 {
-	struct rr_dev *dev = f->private_data;
+	struct rr_file *rf = f->private_data;
+	struct rr_dev *dev = rf->dev;
 	void *base;
 	loff_t pos = *offp;
 	int bar, off, size;
+	ssize_t ret;
 	union {u8 d8; u16 d16; u32 d32; u64 d64;} data;
 	bar = __RR_GET_BAR(pos) / 2; /* index in the array */
 	off = __RR_GET_OFF(pos);
@@ -736,8 +1059,10 @@ static ssize_t rr_write(struct file *f, const char __user *buf, size_t count,
 		writeq(data.d64, base + off);
 		break;
 	default:
-		if (copy_from_user(base + off, buf, count))
-			return -EFAULT;
+		ret = rr_write_bulk(base + off, buf, count, rf->width);
+		if (ret < 0)
+			return ret;
+		count = ret;
 	}
 	*offp += count;
 	return count;
@@ -3,7 +3,12 @@
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/firmware.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+#include <linux/unaligned.h>
+#else
 #include <asm/unaligned.h>
+#endif
 
 #include "rawrabbit.h"
 #include "compat.h"
@@ -26,11 +26,13 @@
 #include<sys/types.h>
 #include<sys/stat.h>
 #include<fcntl.h>
+#include<stdint.h>
 #include<sys/ioctl.h>
 #include"rawrabbit.h"
 
 #define DEFAULT_RR_DEVNAME "/dev/rawrabbit"
 #define RST_ADDR 0xE2000
+#define IOV_WORDS 256 /* words transferred with each RR_IOV */
 
 int rst_zpu(int spec, int rst);
 int copy(int spec, int srcbin, unsigned int baseaddr);
@@ -105,15 +107,17 @@ int main(int argc, char **argv)
 
 int copy(int spec, int srcbin, unsigned int baseaddr)
 {
-  unsigned int bytes, word;
-  struct rr_iocmd iocmd;
-  int ret;
+  unsigned int bytes, word[IOV_WORDS];
+  struct rr_iocmd iocmd[IOV_WORDS];
+  struct rr_iov iov;
+  int ret, i, n;
 
   printf("Writing memory: ");
   bytes=0;
   while(1)
   {
-    ret = read(srcbin, &word, 4); /*read 32-bit word*/
+    memset(word, 0, sizeof(word));
+    ret = read(srcbin, word, sizeof(word)); /*read a block of words*/
     if(ret<0)
     {
       perror("Error while reading binary file");
@@ -125,17 +129,32 @@ int copy(int spec, int srcbin, unsigned int baseaddr)
       break;
     }
 
-    iocmd.address = baseaddr+bytes;
+    n = (ret + 3) / 4;
+    for(i=0; i<n; i++)
+    {
+      iocmd[i].address = baseaddr + bytes + 4*i;
+      iocmd[i].address |= __RR_SET_BAR(0); //bar0
+      iocmd[i].datasize = 4;
+      iocmd[i].data32 = conv_endian(word[i]);
+    }
     bytes += ret;                     //address shift for next write
-    iocmd.address |= __RR_SET_BAR(0); //bar0
-    iocmd.datasize = 4;
-    iocmd.data32 = conv_endian(word);
-    ret = ioctl(spec, RR_WRITE, &iocmd);
+
+    /* all the words in the block with a single system call */
+    iov.cmd = RR_WRITE;
+    iov.nr = n;
+    iov.iocmd = (uintptr_t)iocmd;
+    iov.status = 0;
+    ret = ioctl(spec, RR_IOV, &iov);
     if(ret<0)
     {
       perror("Error while writing to SPEC");
       return -1;
     }
+    if(ret>0)
+    {
+      fprintf(stderr, "Error while writing to SPEC: %i failed writes\n", ret);
+      return -1;
+    }
     if ((bytes & 0x7ff) == 0)
 	    printf(".");
   }
@@ -146,31 +165,28 @@ int copy(int spec, int srcbin, unsigned int baseaddr)
 
 int dump_to_file(int spec, char *filename, unsigned int baseaddr)
 {
-  unsigned int bytes, word;
-  struct rr_iocmd iocmd;
-  int ret;
+  static unsigned int word[0x10000 / 4];
+  int i, ret;
   FILE *f= fopen(filename,"wb");
 
   if(!f)
   return -1;
 
-  bytes=0;
-  while(bytes < 0x10000)
+  /* read the whole area at once, with 32-bit accesses */
+  ioctl(spec, RR_SETWIDTH, 4);
+  lseek(spec, baseaddr | __RR_SET_BAR(0), SEEK_SET); //bar0
+  ret = read(spec, word, sizeof(word));
+  if(ret != sizeof(word))
   {
-
-    iocmd.address = baseaddr+bytes;
-  //  bytes += ret;                     //address shift for next write
-    iocmd.address |= __RR_SET_BAR(0); //bar0
-    iocmd.datasize = 4;
-    iocmd.data32 = 0;
-    ret = ioctl(spec, RR_READ, &iocmd);
-	word = conv_endian(iocmd.data32);
-	fwrite(&word, 4, 1, f);
-
-	bytes+=4;
-
+    perror("Error while reading SPEC memory");
+    fclose(f);
+    return -1;
   }
 
+  for(i=0; i<ret/4; i++)
+    word[i] = conv_endian(word[i]);
+  fwrite(word, 4, ret/4, f);
+
 	fclose(f);
 	return 0;
 }
@@ -178,17 +194,19 @@ int dump_to_file(int spec, char *filename, unsigned int baseaddr)
 
 int verify(int spec, int srcbin, unsigned int baseaddr)
 {
-  unsigned int wbin;
-  struct rr_iocmd iocmd;
+  unsigned int wbin[IOV_WORDS];
+  struct rr_iocmd iocmd[IOV_WORDS];
+  struct rr_iov iov;
   unsigned int bytes;
-  int ret;
+  int ret, i, n;
 
   printf("Verifing: ");
 
   bytes = 0;
   while(1)
   {
-    ret = read(srcbin, &wbin, 4); /*read 32-bit word*/
+    memset(wbin, 0, sizeof(wbin));
+    ret = read(srcbin, wbin, sizeof(wbin)); /*read a block of words*/
     if(ret<0)
     {
       perror("Error while reading binary file");
@@ -200,25 +218,40 @@ int verify(int spec, int srcbin, unsigned int baseaddr)
       break;
     }
 
-    iocmd.address = baseaddr+bytes;
-    bytes += ret;
-    iocmd.address |= __RR_SET_BAR(0); //bar0
-    iocmd.datasize = 4;
-    ret = ioctl(spec, RR_READ, &iocmd);
+    n = (ret + 3) / 4;
+    for(i=0; i<n; i++)
+    {
+      iocmd[i].address = baseaddr + bytes + 4*i;
+      iocmd[i].address |= __RR_SET_BAR(0); //bar0
+      iocmd[i].datasize = 4;
+    }
+
+    iov.cmd = RR_READ;
+    iov.nr = n;
+    iov.iocmd = (uintptr_t)iocmd;
+    iov.status = 0;
+    ret = ioctl(spec, RR_IOV, &iov);
     if(ret<0)
     {
       perror("Error while reading SPEC memory");
       return -1;
     }
-
-    if(iocmd.data32 != conv_endian(wbin))
+    if(ret>0)
     {
-      printf("Error (@word %u)\n", bytes/4);
+      fprintf(stderr, "Error while reading SPEC memory: %i failed reads\n", ret);
       return -1;
     }
-    printf(".");
 
-    return 0;
+    for(i=0; i<n; i++)
+    {
+      if(iocmd[i].data32 != conv_endian(wbin[i]))
+      {
+        printf("Error (@word %u)\n", bytes/4 + i + 1);
+        return -1;
+      }
+    }
+    bytes += 4*n;
+    printf(".");
   }
 
   return 0;
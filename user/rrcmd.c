@@ -34,7 +34,11 @@ void help(void)
 	fprintf(stderr, "   <cmd> = irqwait\n");
 	fprintf(stderr, "   <cmd> = irqena\n");
 	fprintf(stderr, "   <cmd> = getdmasize\n");
+	fprintf(stderr, "   <cmd> = setdmasize <size>\n");
 	fprintf(stderr, "   <cmd> = getplist\n");
+	fprintf(stderr, "   <cmd> = getdmalist\n");
+	fprintf(stderr, "   <cmd> = dma r|w <devaddr> <bufoffset> <len>\n");
+	fprintf(stderr, "   <cmd> = latency [reset]\n");
 	fprintf(stderr, "   <cmd> = r[<sz>] <bar>:<addr>\n");
 	fprintf(stderr, "   <cmd> = w[<sz>] <bar>:<addr> <val>\n");
 	fprintf(stderr, "      <sz> = 1, 2, 4, 8 (default = 4)\n");
@@ -188,6 +192,90 @@ int do_getplist(int fd)
 	return 0;
 }
 
+int do_getdmalist(int fd)
+{
+	struct rr_dmaseg seg[64];
+	struct rr_dmalist list;
+	int i;
+
+	memset(&list, 0, sizeof(list));
+	do {
+		list.nseg = sizeof(seg) / sizeof(seg[0]);
+		list.segs = (uintptr_t)seg;
+		if (ioctl(fd, RR_GETDMALIST, &list) < 0)
+			return -errno;
+		for (i = 0; i < list.nseg; i++)
+			printf("seg %4i: addr 0x%016llx, len 0x%llx\n",
+			       list.first + i,
+			       (unsigned long long)seg[i].addr,
+			       (unsigned long long)seg[i].len);
+		list.first += list.nseg;
+	} while (list.nseg && list.first < list.total);
+	return 0;
+}
+
+/* Run the DMA engine on the device buffer: "r" reads from the device */
+int do_dma(int fd, char *dir, char *devaddr, char *offset, char *len)
+{
+	struct rr_dmareq req;
+	int ret;
+
+	memset(&req, 0, sizeof(req));
+	if (!strcmp(dir, "w"))
+		req.flags = RR_DMA_TODEVICE;
+	else if (strcmp(dir, "r"))
+		return -EINVAL;
+	req.devaddr = strtoul(devaddr, NULL, 16);
+	req.offset = strtoull(offset, NULL, 16);
+	req.len = strtoull(len, NULL, 16);
+
+	ret = ioctl(fd, RR_DMA, &req);
+	if (ret < 0 && errno != EIO)
+		return -errno;
+	/* with EIO, the engine reported an error: show what happened */
+	ret = ret < 0 ? -errno : 0;
+	printf("status %i: 0x%llx bytes in %lli ns\n", req.status,
+	       (unsigned long long)req.bytes, (long long)req.nsec);
+	return ret;
+}
+
+static void print_hist(char *name, struct rr_hist *h)
+{
+	int i;
+
+	printf("%s: %llu samples", name, (unsigned long long)h->count);
+	if (!h->count) {
+		putchar('\n');
+		return;
+	}
+	printf(", min %llu ns, avg %llu ns, max %llu ns\n",
+	       (unsigned long long)h->min,
+	       (unsigned long long)(h->sum / h->count),
+	       (unsigned long long)h->max);
+	for (i = 0; i < RR_HIST_BUCKETS; i++)
+		if (h->bucket[i])
+			printf("   %10llu ns%s: %lu\n", 1ULL << i,
+			       i == RR_HIST_BUCKETS - 1 ? "+" : " ",
+			       (unsigned long)h->bucket[i]);
+}
+
+/* Print the latency histograms, and optionally reset them */
+int do_latency(int fd, char *reset)
+{
+	struct rr_latency lat;
+
+	memset(&lat, 0, sizeof(lat));
+	if (reset) {
+		if (strcmp(reset, "reset"))
+			return -EINVAL;
+		lat.flags = RR_LATENCY_RESET;
+	}
+	if (ioctl(fd, RR_LATENCY, &lat) < 0)
+		return -errno;
+	print_hist("wakeup", &lat.wakeup);
+	print_hist("ack", &lat.ack);
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
@@ -246,8 +334,24 @@ int main(int argc, char **argv)
 		printf("dmasize: %i (0x%x -- %g MB)\n", ret, ret,
 		       ret / (double)(1024*1024));
 		ret = 0;
+	} else if (argc == 3 && !strcmp(argv[1], "setdmasize")) {
+		ret = ioctl(fd, RR_SETDMASIZE, strtoul(argv[2], NULL, 0));
+		if (ret < 0) {
+			fprintf(stderr, "%s: ioctl(SETDMASIZE): %s\n", argv[0],
+				strerror(errno));
+		} else {
+			printf("dmasize: %i (0x%x -- %g MB)\n", ret, ret,
+			       ret / (double)(1024*1024));
+			ret = 0;
+		}
 	} else if (argc > 1 && !strcmp(argv[1], "getplist")) {
 		ret = do_getplist(fd);
+	} else if (argc > 1 && !strcmp(argv[1], "getdmalist")) {
+		ret = do_getdmalist(fd);
+	} else if ((argc == 2 || argc == 3) && !strcmp(argv[1], "latency")) {
+		ret = do_latency(fd, argv[2] /* may be NULL */);
+	} else if (argc == 6 && !strcmp(argv[1], "dma")) {
+		ret = do_dma(fd, argv[2], argv[3], argv[4], argv[5]);
 	} else if (argc == 3 || argc == 4) {
 		ret = do_iocmd(fd, argv[1], argv[2], argv[3] /* may be NULL */);
 	} else if (argc > 4) {